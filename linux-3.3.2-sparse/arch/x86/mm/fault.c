@@ -1089,11 +1089,11 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 
 #ifdef CONFIG_OLEOLE
 	/*
-	 *  Oleole VM may cause #PF exceptions with PF_RSVD.
+	 *  Oleole VM may cause #PF exceptions with PF_RSVD.  Whether the
+	 *  address belongs to it is checked once the vma is known.
 	 */
-	if (unlikely(error_code & PF_RSVD))
-		if (!is_vm_oleoletlb_page(vma))
-			pgtable_bad(regs, error_code, address);
+	if (unlikely((error_code & PF_RSVD) && !mm))
+		pgtable_bad(regs, error_code, address);
 #else  /* CONFIG_OLEOLE */
 	if (unlikely(error_code & PF_RSVD))
 		pgtable_bad(regs, error_code, address);
@@ -1110,6 +1110,13 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 		return;
 	}
 
+#ifdef CONFIG_OLEOLE
+	/* the oleolevm window is found without mmap_sem and find_vma() */
+	if ((error_code & PF_USER) &&
+	    oleolevm_fast_fault(mm, address, flags, regs, error_code))
+		return;
+#endif /* CONFIG_OLEOLE */
+
 	/*
 	 * When running in the kernel we expect faults to occur only to
 	 * addresses in user space.  All other faults represent errors in
@@ -1144,6 +1151,14 @@ retry:
 	}
 
 	vma = find_vma(mm, address);
+#ifdef CONFIG_OLEOLE
+	if (unlikely(error_code & PF_RSVD)) {
+		if (!vma || address < vma->vm_start || !is_vm_oleoletlb_page(vma)) {
+			up_read(&mm->mmap_sem);
+			pgtable_bad(regs, error_code, address);
+		}
+	}
+#endif /* CONFIG_OLEOLE */
 	if (unlikely(!vma)) {
 		bad_area(regs, error_code, address);
 		return;
@@ -0,0 +1,211 @@
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
+
+#include <linux/oleole.h>
+#include <linux/oleoletlb.h>
+#include <linux/oleole_ioctl.h>
+
+#include "oleole_internal.h"
+
+
+/*
+ *  Dirty logging
+ *
+ *  While enabled, a shadow entry is only made writable by a write fault,
+ *  which first sets the frame's bit in dirty_bitmap.  Reading the log
+ *  swaps in a clean bitmap and write-protects every shadow again, both
+ *  with faults excluded so no write fault can slip in between.
+ *  dirty_mutex keeps readers of the log from sharing the spare, and
+ *  writes through the proc fd of an unmapped guest, which no fault lock
+ *  covers, away from the bitmaps.  2MB mappings are not used while
+ *  logging.
+ *
+ *  Frames pinned by get_user_pages(), or copied into through the proc
+ *  fd, are logged when they are taken but can be written until they are
+ *  let go, after the log has been read.  So every frame still pinned
+ *  when the log is read is logged again in the fresh bitmap.
+ */
+
+static unsigned long dirty_bitmap_size(oleole_guest_system_t *gsys)
+{
+	return BITS_TO_LONGS(gsys->dirty_frames) * sizeof(long);
+}
+
+
+/*
+ *  A frame table's own hold on a frame is one reference and one map
+ *  count (oleole_frame_get()), so a frame with more references than map
+ *  counts is pinned.  Only frames in the old log can be pinned for
+ *  writing: they are logged again on every read until unpinned.
+ */
+static void relog_pinned_frames(oleole_guest_system_t *gsys, unsigned long *old)
+{
+	unsigned long gfn, pfn;
+	struct page *page;
+	oleole_frame_table_t *table;
+
+	rcu_read_lock();
+	table = rcu_dereference(gsys->frames);
+	if (table) {
+		for_each_set_bit(gfn, old, min(gsys->dirty_frames, table->nr_frames)) {
+			pfn = ACCESS_ONCE(table->pfn[gfn]);
+			if (!pfn)
+				continue;
+
+			page = pfn_to_page(pfn);
+			if (page_count(page) > page_mapcount(page))
+				set_bit(gfn, gsys->dirty_bitmap);
+		}
+	}
+	rcu_read_unlock();
+}
+
+
+/*
+ *  Exclude faults on the mapped window, if any.  The mm is pinned and
+ *  the mapping checked again once mmap_sem is held, as a concurrent
+ *  munmap or exit may take it away.
+ */
+static struct mm_struct *lock_guest(oleole_guest_system_t *gsys)
+{
+	unsigned long flags;
+	struct mm_struct *mm = NULL;
+
+	spin_lock_irqsave(&gsys->lock, flags);
+	if (gsys->vma && atomic_inc_not_zero(&gsys->vma->vm_mm->mm_users))
+		mm = gsys->vma->vm_mm;
+	spin_unlock_irqrestore(&gsys->lock, flags);
+
+	if (!mm)
+		return NULL;
+
+	oleole_lock_faults(gsys, mm);
+
+	if (!gsys->vma || gsys->vma->vm_mm != mm) {
+		/* unmapped meanwhile */
+		oleole_unlock_faults(gsys, mm);
+		mmput(mm);
+		return NULL;
+	}
+
+	return mm;
+}
+
+
+static void unlock_guest(oleole_guest_system_t *gsys, struct mm_struct *mm)
+{
+	if (!mm)
+		return;
+
+	oleole_unlock_faults(gsys, mm);
+	mmput(mm);
+}
+
+
+int oleole_dirty_log_enable(oleole_guest_system_t *gsys, int enable)
+{
+	unsigned long *bitmap = NULL, *spare = NULL;
+	unsigned long frames;
+	struct mm_struct *mm;
+
+	mutex_lock(&gsys->dirty_mutex);
+
+	if (enable) {
+		if (gsys->dirty_bitmap)
+			goto out;
+
+		frames = gsys->guest_phy_mem_size >> PAGE_SHIFT;
+
+		bitmap = vzalloc(BITS_TO_LONGS(frames) * sizeof(long));
+		spare  = vzalloc(BITS_TO_LONGS(frames) * sizeof(long));
+		if (!bitmap || !spare) {
+			vfree(bitmap);
+			vfree(spare);
+			mutex_unlock(&gsys->dirty_mutex);
+			return -ENOMEM;
+		}
+	}
+
+	mm = lock_guest(gsys);
+
+	if (enable) {
+		gsys->dirty_frames = frames;
+		gsys->dirty_spare  = spare;
+		gsys->dirty_bitmap = bitmap;
+		if (mm)
+			oleole_wrprotect_guest_all(gsys);
+		bitmap = spare = NULL;
+	} else {
+		bitmap = gsys->dirty_bitmap;
+		spare  = gsys->dirty_spare;
+		gsys->dirty_bitmap = NULL;
+		gsys->dirty_spare  = NULL;
+	}
+
+	unlock_guest(gsys, mm);
+
+	vfree(bitmap);
+	vfree(spare);
+
+out:
+	mutex_unlock(&gsys->dirty_mutex);
+
+	return 0;
+}
+
+
+/*
+ *  The log is copied out of a snapshot, so that no fault on the user
+ *  buffer is taken with dirty_mutex held.
+ */
+int oleole_get_dirty_log(oleole_guest_system_t *gsys, const struct oleole_dirty_log *log)
+{
+	unsigned long *bitmap, *snapshot;
+	unsigned long len;
+	struct mm_struct *mm;
+	int ret = 0;
+
+	mutex_lock(&gsys->dirty_mutex);
+
+	if (!gsys->dirty_bitmap || log->size < DIV_ROUND_UP(gsys->dirty_frames, 8)) {
+		mutex_unlock(&gsys->dirty_mutex);
+		return -EINVAL;
+	}
+
+	len = DIV_ROUND_UP(gsys->dirty_frames, 8);
+
+	snapshot = vmalloc(dirty_bitmap_size(gsys));
+	if (!snapshot) {
+		mutex_unlock(&gsys->dirty_mutex);
+		return -ENOMEM;
+	}
+
+	mm = lock_guest(gsys);
+
+	bitmap = gsys->dirty_bitmap;
+	gsys->dirty_bitmap = gsys->dirty_spare;
+	gsys->dirty_spare  = bitmap;
+
+	relog_pinned_frames(gsys, bitmap);
+
+	if (mm)
+		oleole_wrprotect_guest_all(gsys);
+
+	unlock_guest(gsys, mm);
+
+	memcpy(snapshot, bitmap, dirty_bitmap_size(gsys));
+
+	/* the spare must be clean before the next swap */
+	memset(bitmap, 0, dirty_bitmap_size(gsys));
+
+	mutex_unlock(&gsys->dirty_mutex);
+
+	if (copy_to_user((void __user *)(unsigned long)log->bitmap, snapshot, len))
+		ret = -EFAULT;
+
+	vfree(snapshot);
+
+	return ret;
+}
@@ -1,6 +1,9 @@
 #include <linux/mm.h>
 #include <linux/sched.h>
 #include <linux/signal.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+#include <linux/srcu.h>
 
 #include <asm/tlbflush.h> /* for __flush_tlb() */
 
@@ -29,14 +32,23 @@ typedef struct {
 	struct pt_regs *regs;
 	unsigned long error_code;
 	struct task_struct *task;
+	int seq;		/* shadow_seq before the guest walk */
 } oleole_fault_t;
 
 
-static int guest_dynamic_address_translation(oleole_guest_system_t *gsys, unsigned long offset, uint32_t *goffset, int *writeprot);
+static int guest_dynamic_address_translation(oleole_guest_system_t *gsys, unsigned long offset, uint32_t *goffset, int *writeprot, uint32_t *segentry, uint32_t *pageentry);
+static uint32_t mark_guest_entries(oleole_guest_system_t *gsys, unsigned long offset, uint32_t ste, uint32_t pte, int write);
 static void map_guest_page(oleole_guest_system_t *gsys, oleole_fault_t *fault, int virt);
+static int map_guest_huge_page(oleole_guest_system_t *gsys, oleole_fault_t *fault);
+static int map_guest_large_segment(oleole_guest_system_t *gsys, oleole_fault_t *fault, uint32_t ste);
+static void fault_around(oleole_guest_system_t *gsys, oleole_fault_t *fault, pte_t *pte, spinlock_t *ptl, uint32_t ste);
 static void throw_exception(struct task_struct *tsk, int signo, int code, unsigned long address, unsigned long error_code);
 
 
+/* faults in flight, see oleole_shadow_seq() */
+struct srcu_struct oleole_fault_srcu;
+
+
 void
 oleolevm_handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 			 unsigned long address, unsigned int flags,
@@ -44,6 +56,7 @@ oleolevm_handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 {
 	oleole_fault_t fault;
 	oleole_guest_system_t *gsys;
+	int idx;
 
 	fault.mm         = mm;
 	fault.vma        = vma;
@@ -61,6 +74,8 @@ oleolevm_handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 
 	fault.offset = address - vma->vm_start;
 
+	idx = srcu_read_lock(&oleole_fault_srcu);
+
 	switch (fault.offset >> 32) {
 		
 	case 0:
@@ -77,57 +92,224 @@ oleolevm_handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 		throw_exception(fault.task, SIGBUS, BUS_ADRERR, address, error_code);
 		break;
 	}
+
+	srcu_read_unlock(&oleole_fault_srcu, idx);
+}
+
+
+/****************************************************************************/
+/* Fast path                                                                */
+/****************************************************************************/
+
+/*
+ *  Mapped windows, by mm.  A user fault inside one is dispatched from
+ *  do_page_fault() before mmap_sem and find_vma(): the lookup is under
+ *  RCU, and the fault runs with the window's fault_sem held for reading
+ *  instead of mmap_sem.  Anything that would make it fail (contention on
+ *  fault_sem, an unmap in progress) sends the fault down the slow path.
+ */
+static struct hlist_head fast_hash[1 << OLEOLE_FAST_HASH_BITS];
+static DEFINE_SPINLOCK(fast_lock);
+
+
+static struct hlist_head *fast_bucket(struct mm_struct *mm)
+{
+	return &fast_hash[hash_ptr(mm, OLEOLE_FAST_HASH_BITS)];
+}
+
+
+/* Called when vma is set up, with mmap_sem held for writing */
+void oleole_fast_register(oleole_guest_system_t *gsys, struct vm_area_struct *vma)
+{
+	spin_lock(&fast_lock);
+	if (!gsys->fast_mm) {
+		gsys->fast_start = vma->vm_start;
+		gsys->fast_end   = vma->vm_end;
+		gsys->fast_mm    = vma->vm_mm;
+		hlist_add_head_rcu(&gsys->fast_link, fast_bucket(vma->vm_mm));
+	}
+	spin_unlock(&fast_lock);
+}
+
+
+/* Called when the window goes away, with fault_sem held for writing, and on free */
+void oleole_fast_unregister(oleole_guest_system_t *gsys)
+{
+	spin_lock(&fast_lock);
+	if (gsys->fast_mm) {
+		hlist_del_init_rcu(&gsys->fast_link);
+		gsys->fast_mm = NULL;
+	}
+	spin_unlock(&fast_lock);
+}
+
+
+/*
+ *  Returns 1 if the fault at address was handled, 0 if it has to take
+ *  the usual path.
+ */
+int oleolevm_fast_fault(struct mm_struct *mm, unsigned long address, unsigned int flags,
+			struct pt_regs *regs, unsigned long error_code)
+{
+	oleole_guest_system_t *gsys, *found = NULL;
+	struct hlist_node *pos;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(gsys, pos, fast_bucket(mm), fast_link) {
+		if (ACCESS_ONCE(gsys->fast_mm) == mm &&
+		    gsys->fast_start <= address && address < gsys->fast_end) {
+			found = gsys;
+			break;
+		}
+	}
+	if (found && !down_read_trylock(&found->fault_sem))
+		found = NULL;
+
+	/*
+	 *  Unregistered before we got fault_sem, or mapped twice.  Checked
+	 *  under RCU: teardown only frees gsys, after a grace period, once
+	 *  it is unhashed and fault_sem has been taken for writing.  Still
+	 *  registered, it stays so until up_read().
+	 */
+	if (found && (found->fast_mm != mm || !found->vma ||
+		      found->vma->vm_start != found->fast_start)) {
+		up_read(&found->fault_sem);
+		found = NULL;
+	}
+	rcu_read_unlock();
+
+	if (!found)
+		return 0;
+
+	oleolevm_handle_mm_fault(mm, found->vma, address, flags, regs, error_code);
+
+	up_read(&found->fault_sem);
+
+	return 1;
 }
 
 
 static int
-guest_dynamic_address_translation(oleole_guest_system_t *gsys, unsigned long offset, uint32_t *goffset, int *writeprot)
+guest_dynamic_address_translation(oleole_guest_system_t *gsys, unsigned long offset, uint32_t *goffset, int *writeprot, uint32_t *segentry, uint32_t *pageentry)
 {
 	uint32_t sto, pto; /* segment-table origin, page-table origin */
 	uint32_t sti, pti; /* segment-table index, page-table index */
 	uint32_t ste, pte; /* segment-table entry, page-table entry */
 	uint32_t ste_addr, pte_addr;
+	uint32_t cr3;
+	unsigned int stamp;
+
+	cr3 = gsys->cr3;
+	sto = cr3 & OLEOLE_CR3_STO_MASK;
 
-	sto = gsys->cr3;
+	stamp = oleole_gtlb_stamp(&gsys->gtlb);
 
 	sti = ((offset >> 22) & 0x3FF);
 	pti = ((offset >> 12) & 0x3FF);
 
-	ste_addr = sto + sti * 4;
+	if (!oleole_gtlb_lookup_ste(&gsys->gtlb, cr3, sti, &ste)) {
+		ste_addr = sto + sti * 4;
 
-	if (oleole_read_guest_phy_word(gsys, ste_addr, &ste))
-		return -1;
+		if (oleole_read_guest_phy_word(gsys, ste_addr, &ste))
+			return -1;
 
-	if (!(ste & OLEOLE_PTE_PRESENT))
-		return OLEOLE_PTE_PRESENT;
+		if (!(ste & OLEOLE_PTE_PRESENT))
+			return OLEOLE_PTE_PRESENT;
+
+		oleole_gtlb_insert_ste(&gsys->gtlb, stamp, cr3, sti, ste);
+	}
+
+	*segentry = ste;
+
+	if (ste & OLEOLE_STE_LARGE) {
+		*writeprot = (ste & OLEOLE_PTE_WP);
+		*goffset = (ste & OLEOLE_STE_LARGE_MASK) + (offset & 0x3FF000);
+		*pageentry = ste;
+		return 0;
+	}
 
 	pto = ste & 0xFFFFF000;
 
-	pte_addr = pto + sti * 4;
+	if (!oleole_gtlb_lookup_pte(&gsys->gtlb, cr3, (offset >> 12) & 0xFFFFF, &pte)) {
+		pte_addr = pto + pti * 4;
 
-	if (oleole_read_guest_phy_word(gsys, pte_addr, &pte))
-		return -1;
+		if (oleole_read_guest_phy_word(gsys, pte_addr, &pte))
+			return -1;
 
-	if (!(pte & OLEOLE_PTE_PRESENT))
-		return OLEOLE_PTE_PRESENT;
+		if (!(pte & OLEOLE_PTE_PRESENT))
+			return OLEOLE_PTE_PRESENT;
+
+		oleole_gtlb_insert_pte(&gsys->gtlb, stamp, cr3, (offset >> 12) & 0xFFFFF, pte);
+	}
 
 	*writeprot = (pte & OLEOLE_PTE_WP);
 
 	*goffset = pte & 0xFFFFF000;
 
+	*pageentry = pte;
+
 	return 0;
 }
 
 
+/*
+ *  Set A in the guest entries that translated offset, and D in the leaf
+ *  for a write, as the MMU of the guest would.  Returns the leaf entry.
+ *  The GTLB is updated so that entries already marked are not written
+ *  again.
+ */
+static uint32_t
+mark_guest_entries(oleole_guest_system_t *gsys, unsigned long offset, uint32_t ste, uint32_t pte, int write)
+{
+	uint32_t cr3, sti, ste_addr, leaf_addr, leaf, bits;
+	unsigned int stamp;
+
+	cr3 = gsys->cr3;
+	stamp = oleole_gtlb_stamp(&gsys->gtlb);
+	sti = ((offset >> 22) & 0x3FF);
+	ste_addr = (cr3 & OLEOLE_CR3_STO_MASK) + sti * 4;
+
+	bits = OLEOLE_PTE_ACCESSED | (write ? OLEOLE_PTE_DIRTY : 0);
+
+	if (!(ste & OLEOLE_STE_LARGE)) {
+		if (!(ste & OLEOLE_PTE_ACCESSED) &&
+		    !oleole_set_guest_phy_bits(gsys, ste_addr, OLEOLE_PTE_ACCESSED, &ste) &&
+		    (ste & OLEOLE_PTE_PRESENT))
+			oleole_gtlb_insert_ste(&gsys->gtlb, stamp, cr3, sti, ste);
+
+		leaf = pte;
+		leaf_addr = (ste & 0xFFFFF000) + ((offset >> 12) & 0x3FF) * 4;
+	} else {
+		leaf = ste;
+		leaf_addr = ste_addr;
+	}
+
+	if ((leaf & bits) == bits)
+		return leaf;
+
+	if (oleole_set_guest_phy_bits(gsys, leaf_addr, bits, &leaf) ||
+	    !(leaf & OLEOLE_PTE_PRESENT))
+		return leaf;
+
+	if (ste & OLEOLE_STE_LARGE)
+		oleole_gtlb_insert_ste(&gsys->gtlb, stamp, cr3, sti, leaf);
+	else
+		oleole_gtlb_insert_pte(&gsys->gtlb, stamp, cr3, (offset >> 12) & 0xFFFFF, leaf);
+
+	return leaf;
+}
+
+
 static void
 map_guest_page(oleole_guest_system_t *gsys, oleole_fault_t *fault, int virt)
 {
-	int ret, write, writeprot = 0;
+	int ret, write, writeprot = 0, locked;
 	pte_t *pte;
+	spinlock_t *ptl;
 	struct page *page;
-	unsigned long index, offset, address;
-	unsigned long flags, error_code;
-	uint32_t goffset = 0;
+	unsigned long offset, address;
+	unsigned long error_code;
+	uint32_t goffset = 0, ste = 0, gpte = 0, gva;
 	struct task_struct *task;
 
 	write   = fault->error_code & PF_WRITE;
@@ -138,16 +320,14 @@ map_guest_page(oleole_guest_system_t *gsys, oleole_fault_t *fault, int virt)
 
 	task    = fault->task;
 
-	ret = oleole_get_gPTE_offset_with_alloc(fault->mm, &pte, address);
-	if (unlikely(ret < 0))
-		return;
-
-	*pte = __pte(0);
-
 	if (!virt)
 		goto abs;
 
-	ret = guest_dynamic_address_translation(gsys, offset, &goffset, &writeprot);
+	fault->seq = oleole_shadow_seq(gsys);
+	if (fault->seq & 1)
+		return;		/* shadow being changed: refault */
+
+	ret = guest_dynamic_address_translation(gsys, offset, &goffset, &writeprot, &ste, &gpte);
 	if (ret == OLEOLE_PTE_PRESENT) {
 		throw_exception(task, SIGSEGV, 0x101, address, error_code);
 		return;
@@ -158,7 +338,27 @@ map_guest_page(oleole_guest_system_t *gsys, oleole_fault_t *fault, int virt)
 		throw_exception(task, SIGSEGV, 0x103, address, error_code);
 		return;
 	}
-		
+
+	/* read-only until the guest entry is dirty */
+	gpte = mark_guest_entries(gsys, offset, ste, gpte, write);
+	if (!(gpte & OLEOLE_PTE_DIRTY))
+		writeprot = 1;
+	if (ste & OLEOLE_STE_LARGE)
+		ste = gpte;
+
+	if (gsys->coherent) {
+		gva = offset - OLEOLE_GUSET_VIRT_SPACE_OFFSET;
+		if (ste & OLEOLE_STE_LARGE)
+			oleole_rmap_track_segment(gsys, gsys->cur_root,
+						  gsys->cr3 & OLEOLE_CR3_STO_MASK);
+		else
+			oleole_rmap_track_table(gsys, gsys->cur_root,
+						gsys->cr3 & OLEOLE_CR3_STO_MASK, ste & 0xFFFFF000, gva);
+		oleole_rmap_track_map(gsys, gsys->cur_root, gva, goffset >> PAGE_SHIFT);
+	} else if ((ste & OLEOLE_STE_LARGE) && map_guest_large_segment(gsys, fault, ste)) {
+		return;
+	}
+
 	offset = goffset;
 
 abs:
@@ -168,28 +368,579 @@ abs:
 		return;
 	}
 
-	index = offset / PAGE_SIZE;
+	if (oleole_frame_protected(gsys, offset >> PAGE_SHIFT)) {
+		/* a guest segment or page table */
+		if (write) {
+			/* our own invalidation does not make the walk stale */
+			if (oleole_rmap_unprotect(gsys, offset >> PAGE_SHIFT) && virt)
+				fault->seq += 2;
+		} else {
+			writeprot = 1;
+		}
+	}
+
+	if (!virt && map_guest_huge_page(gsys, fault))
+		return;
+
+retry:
+	page = oleole_get_guest_phy_page(gsys, offset);
+	if (page && gsys->cow && (write || virt) && oleole_frame_shared(page)) {
+		/* copy on write; guest-virtual aliases never share */
+		if (oleole_cow_guest_phy_page(gsys, offset, page) < 0) {
+			throw_exception(fault->task, SIGBUS, 0x102, address, fault->error_code);
+			return;
+		}
+		goto retry;
+	}
+
+	if (!page) {
+		if (!virt && !write) {
+			/* untouched frame: share the zero page until written */
+			page = ZERO_PAGE(0);
+			writeprot = 1;
+		} else {
+			page = oleole_alloc_guest_phy_page(gsys, offset);
+			if (unlikely(!page)) {
+				throw_exception(fault->task, SIGBUS, 0x102, address, fault->error_code);
+				return;
+			}
+		}
+	}
+
+	ret = oleole_get_gPTE_offset_with_alloc(gsys, fault->mm, &pte, &ptl, address);
+	if (unlikely(ret < 0))
+		return;
+
+	/*
+	 *  The zero page and shared frames can be replaced under us; the
+	 *  replacement zaps their mappings under frame_lock.
+	 */
+	locked = (page == ZERO_PAGE(0)) || gsys->cow;
+	if (locked) {
+		struct page *cur;
+
+		spin_lock(&gsys->frame_lock);
+
+		cur = oleole_get_guest_phy_page(gsys, offset);
+		if (cur != ((page == ZERO_PAGE(0)) ? NULL : page))
+			goto unlock;	/* replaced: refault */
+
+		if (page != ZERO_PAGE(0) && gsys->cow && oleole_frame_shared(page)) {
+			if (write || virt)
+				goto unlock;	/* shared again by a fork: refault */
+			writeprot = 1;
+		}
+	}
 
-	spin_lock_irqsave(&guest_phy_page_table[index].lock, flags);
-	page = guest_phy_page_table[index].page;
-	spin_unlock_irqrestore(&guest_phy_page_table[index].lock, flags);
+	if (page != ZERO_PAGE(0) && oleole_dirty_track(gsys, offset >> PAGE_SHIFT, write))
+		writeprot = 1;
 
+	spin_lock(ptl);
+	if (virt && oleole_shadow_changed(gsys, fault->seq)) {
+		/* flushed since the guest walk: refault */
+		spin_unlock(ptl);
+		goto unlock;
+	}
+	oleole_occ_mark(pte);
 	if (writeprot)
 		*pte = mk_pte(page, __pgprot(_PAGE_TABLE & ~_PAGE_RW));
 	else
 		*pte = mk_pte(page, __pgprot(_PAGE_TABLE));
+	spin_unlock(ptl);
 
 	__flush_tlb_one(address);
 
+	if (virt)
+		fault_around(gsys, fault, pte, ptl, ste);
+
+unlock:
+	if (locked)
+		spin_unlock(&gsys->frame_lock);
+
 	return;
 }
 
 
+/*
+ *  Map the 2MB chunk around a guest-physical fault with one PMD entry.
+ *
+ *  Only chunks backed by a single order-9 block qualify, and only while
+ *  none of their frames has to be write-protected.  Returns 0 when the
+ *  fault has to be served with a 4KB PTE instead.
+ */
+static int
+map_guest_huge_page(oleole_guest_system_t *gsys, oleole_fault_t *fault)
+{
+	unsigned long base;
+	pmd_t *pmd;
+	struct page *page;
+	spinlock_t *ptl;
+	int ret;
+
+	base = fault->offset & PMD_MASK;
+
+	if (gsys->cow || gsys->dirty_bitmap)
+		return 0;
+
+	if (!oleole_guest_phy_huge(gsys, base)) {
+		/* populate a whole chunk on the first write into it */
+		if (!(fault->error_code & PF_WRITE) ||
+		    oleole_alloc_guest_phy_huge(gsys, base) < 0)
+			return 0;
+	}
+
+	if (oleole_frames_protected(gsys, base >> PAGE_SHIFT, PTRS_PER_PTE))
+		return 0;
+
+	page = oleole_get_guest_phy_page(gsys, base);
+	if (unlikely(!page))
+		return 0;
+
+	if (oleole_get_gPMD_offset_with_alloc(gsys, fault->mm, &pmd, fault->address) < 0)
+		return 0;
+
+	/*
+	 *  protect_frame() sets the bit before it splits the PMD under the
+	 *  same lock, so either the check below sees the bit or the split
+	 *  sees our entry.
+	 */
+	ptl = oleole_table_lockptr(fault->mm, pmd);
+	spin_lock(ptl);
+	if (oleole_frames_protected(gsys, base >> PAGE_SHIFT, PTRS_PER_PTE)) {
+		spin_unlock(ptl);
+		return 0;
+	}
+	oleole_occ_mark(pmd);
+	if (cmpxchg(&pmd->pmd, 0UL, page_to_phys(page) | _PAGE_TABLE | _PAGE_PSE)) {
+		/* raced with another thread, or already split into a PTE table */
+		ret = pmd_large(*pmd);
+		spin_unlock(ptl);
+		return ret;
+	}
+	spin_unlock(ptl);
+
+	__flush_tlb_one(fault->address & PMD_MASK);
+
+	return 1;
+}
+
+
+/*
+ *  Shadow a guest large segment with two 2MB PMD entries.
+ *
+ *  Each half qualifies when its guest-physical chunk is backed by one
+ *  order-9 block (see map_guest_huge_page()).  Returns 0 when the half
+ *  containing the fault has to be served with 4KB PTEs.
+ */
+static int
+map_guest_large_segment(oleole_guest_system_t *gsys, oleole_fault_t *fault, uint32_t ste)
+{
+	int h, half, ret = 0;
+	unsigned long prot;
+	pmd_t *pmd;
+	spinlock_t *ptl;
+
+	if (gsys->cow || gsys->dirty_bitmap)
+		return 0;
+
+	if (oleole_get_gPMD_offset_with_alloc(gsys, fault->mm, &pmd, fault->address) < 0)
+		return 0;
+
+	ptl = oleole_table_lockptr(fault->mm, pmd);
+
+	half = pmd_index(fault->address) & 1;
+	pmd -= half;
+
+	prot = (ste & OLEOLE_PTE_WP) || !(ste & OLEOLE_PTE_DIRTY) ?
+		(_PAGE_TABLE & ~_PAGE_RW) : _PAGE_TABLE;
+
+	for (h=0 ; h<2 ; h++) {
+		unsigned long base;
+		struct page *page;
+		pmd_t old = pmd[h];
+
+		base = (ste & OLEOLE_STE_LARGE_MASK) + h * PMD_SIZE;
+
+		if (!oleole_guest_phy_huge(gsys, base) &&
+		    (h != half || oleole_alloc_guest_phy_huge(gsys, base) < 0))
+			continue;
+
+		/*
+		 *  empty, a 2MB entry left deactivated by a flush, or one
+		 *  installed read-only before the segment became dirty
+		 */
+		if (!oleole_pmd_none(old) &&
+		    !(pmd_large(old) && (pmd_val(old) & _PAGE_DEACTIVATED)) &&
+		    !(pmd_large(old) && !(pmd_val(old) & _PAGE_RW) && (prot & _PAGE_RW))) {
+			if (h == half && pmd_large(old))
+				ret = 1;	/* raced with another thread */
+			continue;
+		}
+
+		page = oleole_get_guest_phy_page(gsys, base);
+		if (unlikely(!page))
+			continue;
+
+		spin_lock(ptl);
+		if (oleole_shadow_changed(gsys, fault->seq)) {
+			/* flushed since the guest walk: refault */
+			spin_unlock(ptl);
+			return 1;
+		}
+		oleole_occ_mark(&pmd[h]);
+		if (cmpxchg(&pmd[h].pmd, pmd_val(old), page_to_phys(page) | prot | _PAGE_PSE) !=
+		    pmd_val(old)) {
+			spin_unlock(ptl);
+			if (h == half && pmd_large(pmd[h]))
+				ret = 1;	/* raced with another thread */
+			continue;
+		}
+		spin_unlock(ptl);
+
+		if (h == half)
+			ret = 1;
+	}
+
+	if (ret)
+		__flush_tlb_one(fault->address & PMD_MASK);
+
+	return ret;
+}
+
+
+/*
+ *  Fill the neighbours of a guest-virtual fault in one go.
+ *
+ *  The window is aligned to fault_around_pages and never leaves the
+ *  shadow PTE table of the faulting address.  A shadow PTE table covers
+ *  2MB, i.e. one half of a 4MB guest segment, so every entry of the
+ *  window is translated by the same guest page table page, or by the
+ *  same large segment.
+ *  Only empty or deactivated shadow entries are filled; neither can be
+ *  cached by the TLB, so no flush is necessary.  Guest table frames stay
+ *  read-only in coherent mode.  Entries the guest has not accessed are
+ *  skipped and clean ones are mapped read-only, so that A and D are only
+ *  ever set by a real access.
+ *  Each entry is stored under the table lock ptl, which is taken after
+ *  the reverse map is updated (see oleole_pgtable.h for the lock order),
+ *  and the window ends where a flush bumped shadow_seq.
+ */
+static void
+fault_around(oleole_guest_system_t *gsys, oleole_fault_t *fault, pte_t *pte, spinlock_t *ptl, uint32_t ste)
+{
+	unsigned int i, nr, start, fidx, gpti;
+	unsigned long mem_size;
+	uint32_t *gpt = NULL;
+	pte_t *ptebase;
+	struct page *ptpage;
+
+	nr = ACCESS_ONCE(gsys->fault_around_pages);
+	if (nr <= 1)
+		return;
+
+	if (!(ste & OLEOLE_STE_LARGE)) {
+		ptpage = oleole_get_guest_phy_page(gsys, ste & 0xFFFFF000);
+		if (!ptpage)
+			return;
+		gpt = (uint32_t *)page_address(ptpage);
+	}
+
+	mem_size = gsys->guest_phy_mem_size;
+
+	fidx    = pte_index(fault->address);
+	start   = fidx & ~(nr - 1);
+	ptebase = pte - fidx;
+
+	gpti = ((fault->offset >> PAGE_SHIFT) & 0x3FF) - fidx;
+
+	for (i = start ; i < start + nr ; i++) {
+		uint32_t gpte, goffset;
+		struct page *page;
+		pgprot_t prot;
+		pte_t old = ptebase[i];
+
+		if (i == fidx)
+			continue;
+
+		if (!oleole_pte_none(old) && !(pte_val(old) & _PAGE_DEACTIVATED))
+			continue;
+
+		if (gpt)
+			gpte = gpt[gpti + i];
+		else
+			gpte = ((ste & OLEOLE_STE_LARGE_MASK) + ((gpti + i) << PAGE_SHIFT)) |
+				(ste & (OLEOLE_PTE_PRESENT | OLEOLE_PTE_WP |
+					OLEOLE_PTE_ACCESSED | OLEOLE_PTE_DIRTY));
+
+		/* never accessed: left to a fault, which sets A */
+		if ((gpte & (OLEOLE_PTE_PRESENT | OLEOLE_PTE_ACCESSED)) !=
+		    (OLEOLE_PTE_PRESENT | OLEOLE_PTE_ACCESSED))
+			continue;
+
+		goffset = gpte & 0xFFFFF000;
+		if (mem_size <= goffset)
+			continue;
+
+		page = oleole_get_guest_phy_page(gsys, goffset);
+		if (!page)
+			continue;
+
+		/* left to a fault, which copies it (frame_lock is held) */
+		if (gsys->cow && oleole_frame_shared(page))
+			continue;
+
+		if (gsys->coherent)
+			oleole_rmap_track_map(gsys, gsys->cur_root,
+					      (fault->offset - OLEOLE_GUSET_VIRT_SPACE_OFFSET) + ((long)i - fidx) * PAGE_SIZE,
+					      goffset >> PAGE_SHIFT);
+
+		if ((gpte & OLEOLE_PTE_WP) || !(gpte & OLEOLE_PTE_DIRTY) ||
+		    oleole_frame_protected(gsys, goffset >> PAGE_SHIFT) ||
+		    oleole_dirty_track(gsys, goffset >> PAGE_SHIFT, 0))
+			prot = __pgprot(_PAGE_TABLE & ~_PAGE_RW);
+		else
+			prot = __pgprot(_PAGE_TABLE);
+
+		spin_lock(ptl);
+		if (oleole_shadow_changed(gsys, fault->seq)) {
+			spin_unlock(ptl);
+			break;
+		}
+		old = ptebase[i];
+		if (oleole_pte_none(old) || (pte_val(old) & _PAGE_DEACTIVATED)) {
+			oleole_occ_mark(&ptebase[i]);
+			ptebase[i] = mk_pte(page, prot);
+		}
+		spin_unlock(ptl);
+	}
+}
+
+
+/*
+ *  Is address mapped by a live shadow entry?
+ */
+static int shadow_present(struct mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+
+	pgd = pgd_offset(mm, address);
+	if (oleole_pgd_none(*pgd) || (pgd_val(*pgd) & _PAGE_DEACTIVATED))
+		return 0;
+
+	pud = pud_offset(pgd, address);
+	if (oleole_pud_none(*pud) || (pud_val(*pud) & _PAGE_DEACTIVATED))
+		return 0;
+
+	pmd = oleole_pmd_offset(pud, address);
+	if (oleole_pmd_none(*pmd) || (pmd_val(*pmd) & _PAGE_DEACTIVATED))
+		return 0;
+
+	if (pmd_large(*pmd))
+		return 1;
+
+	pte = oleole_pte_offset(pmd, address);
+
+	return pte_present(*pte) && !(pte_val(*pte) & _PAGE_DEACTIVATED);
+}
+
+
+/*
+ *  MADV_WILLNEED: build the shadow of [start, end) as read faults would,
+ *  without signalling anybody when the guest tables say no.  Called with
+ *  mmap_sem held for reading, like the fault handler.
+ */
+void oleole_prefault(oleole_guest_system_t *gsys, struct vm_area_struct *vma,
+		     unsigned long start, unsigned long end)
+{
+	oleole_fault_t fault;
+	unsigned long address;
+	int idx;
+
+	fault.mm         = vma->vm_mm;
+	fault.vma        = vma;
+	fault.flags      = 0;
+	fault.regs       = NULL;
+	fault.error_code = PF_USER;
+	fault.task       = NULL;
+
+	for (address = start ; address < end ; address += PAGE_SIZE) {
+		fault.address = address;
+		fault.offset  = address - vma->vm_start;
+
+		if (!(address & ~PMD_MASK)) {
+			if (fatal_signal_pending(current))
+				break;
+			cond_resched();
+		}
+
+		idx = srcu_read_lock(&oleole_fault_srcu);
+
+		if (shadow_present(fault.mm, address)) {
+			srcu_read_unlock(&oleole_fault_srcu, idx);
+			continue;
+		}
+
+		switch (fault.offset >> 32) {
+		case 0:
+			if (fault.offset < gsys->guest_phy_mem_size)
+				map_guest_page(gsys, &fault, 0);
+			break;
+
+		case 2:
+			map_guest_page(gsys, &fault, 1);
+			break;
+		}
+
+		srcu_read_unlock(&oleole_fault_srcu, idx);
+	}
+}
+
+
+/*
+ *  Resolve one page of either window for get_user_pages(): translate a
+ *  guest-virtual address, make the frame fit for the access as a fault
+ *  would, and return it with a reference held.  Returns NULL when the
+ *  address has no frame behind it.
+ */
+static struct page *
+follow_guest_page(oleole_guest_system_t *gsys, unsigned long offset, int write)
+{
+	struct page *page;
+	uint32_t goffset = 0, ste = 0, gpte = 0;
+	int writeprot = 0;
+
+	switch (offset >> 32) {
+	case 0:
+		break;
+
+	case 2:
+		if (guest_dynamic_address_translation(gsys, offset, &goffset, &writeprot, &ste, &gpte))
+			return NULL;
+		if (write && writeprot)
+			return NULL;
+		mark_guest_entries(gsys, offset, ste, gpte, write);
+		offset = goffset;
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (gsys->guest_phy_mem_size <= offset)
+		return NULL;
+
+	if (!write) {
+		page = oleole_get_guest_phy_page_ref(gsys, offset);
+		if (!page) {
+			/* untouched frame reads as zero */
+			page = ZERO_PAGE(0);
+			get_page(page);
+		}
+		return page;
+	}
+
+	if (oleole_frame_protected(gsys, offset >> PAGE_SHIFT))
+		oleole_rmap_unprotect(gsys, offset >> PAGE_SHIFT);
+
+	for (;;) {
+		page = oleole_get_guest_phy_page_ref(gsys, offset);
+		if (!page) {
+			if (!oleole_alloc_guest_phy_page(gsys, offset))
+				return NULL;
+			continue;
+		}
+
+		if (!gsys->cow || !oleole_frame_shared(page))
+			break;
+
+		/* copy on write, exactly as a write fault would */
+		if (oleole_cow_guest_phy_page(gsys, offset, page) < 0) {
+			put_page(page);
+			return NULL;
+		}
+		put_page(page);
+	}
+
+	oleole_dirty_track(gsys, offset >> PAGE_SHIFT, 1);
+
+	return page;
+}
+
+
+/*
+ *  get_user_pages() on the oleolevm mapping, after follow_hugetlb_page().
+ *
+ *  Frames are found through the frame table rather than the shadow, so
+ *  no shadow entry is built.  Pinned frames stay valid after a release
+ *  or a copy on write; the pin merely outlives the guest's use of them.
+ *  get_user_pages_fast() gets here only when the shadow has no present
+ *  leaf; the leaves it does pin through are never left pointing at a
+ *  released frame (see oleole_flush_guest_virt_all()).
+ *  On an error *length is cleared, so that __get_user_pages() stops,
+ *  and the error is only returned if no page was pinned.
+ *  Called with mmap_sem held for reading.
+ */
+int oleolevm_follow_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			 struct page **pages, struct vm_area_struct **vmas,
+			 unsigned long *position, int *length, int i,
+			 unsigned int flags)
+{
+	oleole_guest_system_t *gsys;
+	unsigned long vaddr = *position;
+	int remainder = *length;
+	int err = -EFAULT;
+	struct page *page;
+
+	gsys = (oleole_guest_system_t *)vma->vm_private_data;
+	if (!gsys)
+		remainder = 0;
+
+	while (vaddr < vma->vm_end && remainder) {
+		if (unlikely(fatal_signal_pending(current))) {
+			err = -ERESTARTSYS;
+			remainder = 0;
+			break;
+		}
+
+		page = follow_guest_page(gsys, vaddr - vma->vm_start, flags & FOLL_WRITE);
+		if (!page) {
+			remainder = 0;
+			break;
+		}
+
+		if (pages)
+			pages[i] = page;
+		else
+			put_page(page);
+
+		if (vmas)
+			vmas[i] = vma;
+
+		vaddr += PAGE_SIZE;
+		--remainder;
+		++i;
+
+		cond_resched();
+	}
+
+	*length = remainder;
+	*position = vaddr;
+
+	return i ? i : err;
+}
+
+
 static void
 throw_exception(struct task_struct *tsk, int signo, int code, unsigned long address, unsigned long error_code)
 {
 	siginfo_t info;
 
+	if (!tsk)
+		return;		/* prefault: nobody to signal */
+
 	tsk->thread.cr2 = address;
 	tsk->thread.error_code = error_code | (address >= TASK_SIZE);
 	tsk->thread.trap_no = 14;
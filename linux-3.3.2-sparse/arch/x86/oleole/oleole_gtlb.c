@@ -0,0 +1,140 @@
+#include <linux/mm.h>
+#include <linux/hash.h>
+#include <linux/string.h>
+
+#include <linux/oleole.h>
+#include <linux/oleoletlb.h>
+
+#include "oleole_internal.h"
+
+
+#define STE_SLOT(gtlb, cr3, sti) \
+	(&(gtlb)->ste[hash_32((cr3) ^ (sti), OLEOLE_GTLB_STE_BITS)])
+
+#define PTE_SLOT(gtlb, cr3, vpn) \
+	(&(gtlb)->pte[hash_32((cr3) ^ (vpn), OLEOLE_GTLB_PTE_BITS)])
+
+
+void oleole_gtlb_init(oleole_gtlb_t *gtlb)
+{
+	seqlock_init(&gtlb->seqlock);
+	memset(gtlb->ste, 0, sizeof(gtlb->ste));
+	memset(gtlb->pte, 0, sizeof(gtlb->pte));
+	gtlb->gen = 1;
+	gtlb->stamp = 0;
+}
+
+
+/*
+ *  A translation read from guest memory may be inserted only if no
+ *  invalidation ran since the read began: the reader takes a stamp
+ *  before reading the guest tables and insert() drops the entry if the
+ *  stamp moved meanwhile.
+ */
+unsigned int oleole_gtlb_stamp(oleole_gtlb_t *gtlb)
+{
+	unsigned int stamp = ACCESS_ONCE(gtlb->stamp);
+	smp_rmb();
+	return stamp;
+}
+
+
+/****************************************************************************/
+/*                                                                          */
+/****************************************************************************/
+
+static int lookup(oleole_gtlb_t *gtlb, const oleole_gtlb_entry_t *e,
+		  uint32_t cr3, uint32_t tag, uint32_t *result)
+{
+	int hit;
+	unsigned seq;
+	uint32_t val;
+
+	do {
+		seq = read_seqbegin(&gtlb->seqlock);
+		hit = (e->gen == gtlb->gen && e->cr3 == cr3 && e->tag == tag);
+		val = e->val;
+	} while (read_seqretry(&gtlb->seqlock, seq));
+
+	if (hit)
+		*result = val;
+
+	return hit;
+}
+
+
+static void insert(oleole_gtlb_t *gtlb, oleole_gtlb_entry_t *e, unsigned int stamp,
+		   uint32_t cr3, uint32_t tag, uint32_t val)
+{
+	write_seqlock(&gtlb->seqlock);
+	if (gtlb->stamp != stamp) {
+		/* invalidated while val was read */
+		write_sequnlock(&gtlb->seqlock);
+		return;
+	}
+	e->gen = gtlb->gen;
+	e->cr3 = cr3;
+	e->tag = tag;
+	e->val = val;
+	write_sequnlock(&gtlb->seqlock);
+}
+
+
+int oleole_gtlb_lookup_ste(oleole_gtlb_t *gtlb, uint32_t cr3, uint32_t sti, uint32_t *ste)
+{
+	return lookup(gtlb, STE_SLOT(gtlb, cr3, sti), cr3, sti, ste);
+}
+
+
+int oleole_gtlb_lookup_pte(oleole_gtlb_t *gtlb, uint32_t cr3, uint32_t vpn, uint32_t *pte)
+{
+	return lookup(gtlb, PTE_SLOT(gtlb, cr3, vpn), cr3, vpn, pte);
+}
+
+
+void oleole_gtlb_insert_ste(oleole_gtlb_t *gtlb, unsigned int stamp, uint32_t cr3, uint32_t sti, uint32_t ste)
+{
+	insert(gtlb, STE_SLOT(gtlb, cr3, sti), stamp, cr3, sti, ste);
+}
+
+
+void oleole_gtlb_insert_pte(oleole_gtlb_t *gtlb, unsigned int stamp, uint32_t cr3, uint32_t vpn, uint32_t pte)
+{
+	insert(gtlb, PTE_SLOT(gtlb, cr3, vpn), stamp, cr3, vpn, pte);
+}
+
+
+/****************************************************************************/
+/* Invalidation                                                             */
+/****************************************************************************/
+
+void oleole_gtlb_flush(oleole_gtlb_t *gtlb)
+{
+	write_seqlock(&gtlb->seqlock);
+	gtlb->stamp++;
+	if (unlikely(++gtlb->gen == 0)) {
+		/* generation wrapped: old entries could match again */
+		memset(gtlb->ste, 0, sizeof(gtlb->ste));
+		memset(gtlb->pte, 0, sizeof(gtlb->pte));
+		gtlb->gen = 1;
+	}
+	write_sequnlock(&gtlb->seqlock);
+}
+
+
+/* Like INVLPG, this also drops the segment-table entry used for vaddr */
+void oleole_gtlb_flush_page(oleole_gtlb_t *gtlb, uint32_t cr3, uint32_t vaddr)
+{
+	uint32_t vpn = vaddr >> 12;
+	uint32_t sti = vaddr >> 22;
+	oleole_gtlb_entry_t *e = PTE_SLOT(gtlb, cr3, vpn);
+	oleole_gtlb_entry_t *s = STE_SLOT(gtlb, cr3, sti);
+
+	write_seqlock(&gtlb->seqlock);
+	gtlb->stamp++;
+	if (e->cr3 == cr3 && e->tag == vpn)
+		e->gen = 0;
+	if (s->cr3 == cr3 && s->tag == sti)
+		s->gen = 0;
+	write_sequnlock(&gtlb->seqlock);
+}
@@ -1,6 +1,10 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/workqueue.h>
+#include <linux/cpu.h>
+#include <linux/sched.h>
 
 #include <linux/oleole.h>
 #include <linux/oleoletlb.h>
@@ -9,113 +13,679 @@
 #include "oleole_internal.h"
 
 
-oleole_guest_phy_page_t *guest_phy_page_table;
-
-
 oleole_guest_system_t *oleole_guest_system_alloc(void)
 {
 	oleole_guest_system_t *gsys;
 
 	gsys = kzalloc(sizeof(oleole_guest_system_t), GFP_KERNEL);
+	if (!gsys)
+		return NULL;
+
 	spin_lock_init(&gsys->lock);
+	init_rwsem(&gsys->fault_sem);
+	INIT_HLIST_NODE(&gsys->fast_link);
+	mutex_init(&gsys->frames_mutex);
+	mutex_init(&gsys->dirty_mutex);
+	spin_lock_init(&gsys->frame_lock);
+	INIT_LIST_HEAD(&gsys->clones);
+	INIT_LIST_HEAD(&gsys->clone_link);
+	gsys->fault_around_pages = OLEOLE_FAULT_AROUND_DEFAULT;
+	oleole_gtlb_init(&gsys->gtlb);
+	mutex_init(&gsys->shadow_mutex);
+	INIT_LIST_HEAD(&gsys->roots);
+	spin_lock_init(&gsys->rmap_lock);
+	INIT_LIST_HEAD(&gsys->rmap_rootless);
 
 	return gsys;
 }
 
 
+static void free_guest_system_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, oleole_guest_system_t, rcu));
+}
+
+
+/*
+ *  The fault fast path may still be looking at the structure itself, not
+ *  at anything it points to, so only that waits for a grace period.  A
+ *  fast fault that found gsys before it was unhashed either holds
+ *  fault_sem, and is waited for here, or sees it unregistered.
+ */
 void oleole_guest_system_dealloc(oleole_guest_system_t *gsys)
 {
-	kfree(gsys);
+	oleole_fast_unregister(gsys);
+	down_write(&gsys->fault_sem);
+	up_write(&gsys->fault_sem);
+
+	oleole_rmap_destroy(gsys);
+	vfree(gsys->dirty_bitmap);
+	vfree(gsys->dirty_spare);
+	vfree(gsys->frames);
+	call_rcu(&gsys->rcu, free_guest_system_rcu);
+}
+
+
+static oleole_frame_table_t *alloc_frame_table(unsigned long nr_frames)
+{
+	unsigned long huge_words;
+	oleole_frame_table_t *table;
+
+	huge_words = BITS_TO_LONGS(DIV_ROUND_UP(nr_frames, 1UL << OLEOLE_GUEST_PHY_HUGE_ORDER));
+
+	table = vzalloc(sizeof(oleole_frame_table_t) +
+			sizeof(unsigned long) * (nr_frames + huge_words));
+	if (!table)
+		return NULL;
+
+	table->nr_frames = nr_frames;
+	table->huge_map  = table->pfn + nr_frames;
+
+	return table;
+}
+
+
+/*
+ *  Make room for nr_frames guest frames.  The table is replaced, not
+ *  resized in place, so lookups never need the mutex.  The copy is made
+ *  under frame_lock, which publish_frames() and copy-on-write hold, so no
+ *  frame goes into the old table after it has been copied.
+ */
+static int grow_frame_table(oleole_guest_system_t *gsys, unsigned long nr_frames)
+{
+	oleole_frame_table_t *old, *new;
+
+	old = gsys->frames;
+	if (old && nr_frames <= old->nr_frames)
+		return 0;
+
+	new = alloc_frame_table(nr_frames);
+	if (!new)
+		return -ENOMEM;
+
+	spin_lock(&gsys->frame_lock);
+
+	if (old) {
+		memcpy(new->pfn, old->pfn, sizeof(unsigned long) * old->nr_frames);
+		bitmap_copy(new->huge_map, old->huge_map,
+			    DIV_ROUND_UP(old->nr_frames, 1UL << OLEOLE_GUEST_PHY_HUGE_ORDER));
+	}
+
+	rcu_assign_pointer(gsys->frames, new);
+
+	spin_unlock(&gsys->frame_lock);
+
+	if (old) {
+		synchronize_rcu();
+		vfree(old);
+	}
+
+	return 0;
 }
 
 
-unsigned long oleole_map_guest_phy_memory(unsigned long old_size, unsigned long new_size)
+/*
+ *  Guest physical memory is populated on demand.
+ *
+ *  START only sizes the frame table; frames are allocated by the first
+ *  write fault (or any guest-virtual fault) that touches them, while
+ *  reads of untouched frames see the zero page.
+ *
+ *  Frames are published with cmpxchg under frame_lock, by faults, the
+ *  POPULATE workers and writes through the proc fd; none of them takes
+ *  frames_mutex.  Resizing holds frame_lock while it copies or clears
+ *  the table, so a frame published meanwhile is neither lost nor leaked.
+ */
+unsigned long oleole_map_guest_phy_memory(oleole_guest_system_t *gsys, unsigned long old_size, unsigned long new_size)
 {
 	unsigned long ret;
 	unsigned long s;
+	struct page *page, *next;
+	oleole_frame_table_t *table;
+	LIST_HEAD(freed);
 
 	if (old_size == new_size)
 		return new_size;
 
+	mutex_lock(&gsys->frames_mutex);
+
 	if (new_size < old_size)
 		goto shrink;
 
-	for (s = old_size ; s < new_size ; s += PAGE_SIZE) {
-		int index;
-		unsigned long flags;
-		struct page *page;
-		void* p;
+	ret = new_size;
+
+	if (grow_frame_table(gsys, new_size >> PAGE_SHIFT) < 0)
+		ret = old_size;
+
+	mutex_unlock(&gsys->frames_mutex);
+
+	return ret;
+
+shrink:
+	spin_lock(&gsys->frame_lock);
+
+	table = gsys->frames;
+
+	for (s = new_size ; s < old_size ; s += PAGE_SIZE) {
+		unsigned long pfn;
+
+		clear_bit(s >> PMD_SHIFT, table->huge_map);
+
+		pfn = table->pfn[s >> PAGE_SHIFT];
+		table->pfn[s >> PAGE_SHIFT] = 0;
+
+		if (pfn)
+			list_add(&pfn_to_page(pfn)->lru, &freed);
+	}
+
+	spin_unlock(&gsys->frame_lock);
+
+	/* wait for lookups that may still use one of the old frames */
+	synchronize_rcu();
+
+	list_for_each_entry_safe(page, next, &freed, lru) {
+		list_del(&page->lru);
+		oleole_frame_put(page);
+	}
+
+	mutex_unlock(&gsys->frames_mutex);
+
+	return new_size;
+}
+
+
+/*
+ *  Allocate the frames for guest address addr.
+ *
+ *  A node mask set with OLEOLE_IOC_NODEMASK wins and spreads the guest
+ *  over its nodes in 2MB stripes.  Otherwise the policy of the window
+ *  (mbind) or of the faulting task (set_mempolicy) applies, with addr
+ *  taken as the guest-physical window address so interleaving depends
+ *  on the frame, not on the alias it was reached through.  Without a
+ *  mapping, e.g. while populating, frames come from the local node.
+ */
+static struct page *alloc_guest_frames(oleole_guest_system_t *gsys, unsigned long addr,
+				       gfp_t gfp, int order)
+{
+	struct vm_area_struct *vma;
+	unsigned int n, nid;
+	nodemask_t nodes;
+
+	/* the ioctl may change the mask meanwhile: work on one snapshot */
+	spin_lock(&gsys->frame_lock);
+	nodes = gsys->nodes;
+	spin_unlock(&gsys->frame_lock);
+
+	if (!nodes_empty(nodes)) {
+		n = (addr >> PMD_SHIFT) % nodes_weight(nodes);
+
+		nid = first_node(nodes);
+		while (n--)
+			nid = next_node(nid, nodes);
+
+		return alloc_pages_node(nid, gfp, order);
+	}
+
+	vma = gsys->vma;
+	if (vma)
+		return alloc_pages_vma(gfp, order, vma,
+				       vma->vm_start + OLEOLE_GUSET_PHY_SPACE_OFFSET + addr,
+				       numa_node_id());
+
+	return alloc_pages(gfp, order);
+}
+
+
+/*
+ *  Publish the 1 << order zeroed (and split) frames at page as guest
+ *  frames from base on.  Slots filled by somebody else keep their frame
+ *  and ours is freed.  Returns the number of such slots.
+ */
+static int publish_frames(oleole_guest_system_t *gsys, unsigned long base,
+			  struct page *page, int order)
+{
+	int i, lost = 0;
+	unsigned long pfn;
+	oleole_frame_table_t *table;
+
+	/* contents must be visible before the frames are */
+	smp_wmb();
+
+	pfn = page_to_pfn(page);
+
+	spin_lock(&gsys->frame_lock);
+
+	rcu_read_lock();
+	table = rcu_dereference(gsys->frames);
+	for (i=0 ; i<(1 << order) ; i++) {
+		if (cmpxchg(&table->pfn[(base >> PAGE_SHIFT) + i], 0UL, pfn + i)) {
+			__free_page(page + i);
+			lost++;
+			continue;
+		}
+		oleole_frame_get(page + i);
+	}
+	if (!lost && order == OLEOLE_GUEST_PHY_HUGE_ORDER)
+		set_bit(base >> PMD_SHIFT, table->huge_map);
+	rcu_read_unlock();
+
+	/* drop zero-page mappings of the frames */
+	if (lost < (1 << order))
+		oleole_zap_guest_phy_range(gsys, base, PAGE_SIZE << order);
+
+	spin_unlock(&gsys->frame_lock);
+
+	return lost;
+}
 
-		page = alloc_page(GFP_KERNEL);
+
+/*
+ *  Look up guest frame addr and take a reference on it, for users that
+ *  may sleep while they access it.  NULL if the frame is not backed.
+ */
+struct page *oleole_get_guest_phy_page_ref(oleole_guest_system_t *gsys, unsigned long addr)
+{
+	struct page *page;
+
+	rcu_read_lock();
+	for (;;) {
+		page = oleole_get_guest_phy_page(gsys, addr);
 		if (!page)
 			break;
 
-		p = page_address(page);
-		memset(p, 0, PAGE_SIZE);
+		if (!get_page_unless_zero(page))
+			continue;	/* being freed */
+
+		/* it may have been freed and reused meanwhile */
+		if (oleole_get_guest_phy_page(gsys, addr) == page)
+			break;
+
+		put_page(page);
+	}
+	rcu_read_unlock();
+
+	return page;
+}
+
 
-		index = s / PAGE_SIZE;
+/*
+ *  Back guest frame addr with a zeroed page, unless somebody else did.
+ */
+struct page *oleole_alloc_guest_phy_page(oleole_guest_system_t *gsys, unsigned long addr)
+{
+	struct page *page;
 
-		spin_lock_irqsave(&guest_phy_page_table[index].lock, flags);
-		guest_phy_page_table[index].page = page;
-		spin_unlock_irqrestore(&guest_phy_page_table[index].lock, flags);
+	page = alloc_guest_frames(gsys, addr, GFP_KERNEL | __GFP_ZERO, 0);
+	if (!page)
+		return NULL;
 
-		ret = s + PAGE_SIZE;
+	if (publish_frames(gsys, addr & PAGE_MASK, page, 0))
+		return oleole_get_guest_phy_page(gsys, addr);	/* lost the race */
+
+	return page;
+}
+
+
+/* Is no frame of the 2MB chunk at base populated yet? */
+static int chunk_untouched(oleole_guest_system_t *gsys, unsigned long base)
+{
+	int i;
+	oleole_frame_table_t *table;
+
+	rcu_read_lock();
+	table = rcu_dereference(gsys->frames);
+	for (i=0 ; i<(1 << OLEOLE_GUEST_PHY_HUGE_ORDER) ; i++)
+		if (ACCESS_ONCE(table->pfn[(base >> PAGE_SHIFT) + i]))
+			break;
+	rcu_read_unlock();
+
+	return i == (1 << OLEOLE_GUEST_PHY_HUGE_ORDER);
+}
+
+
+/*
+ *  Back the untouched 2MB chunk at base with one order-9 block, so it
+ *  can be mapped with a single PMD entry.  Returns 0 when the chunk is
+ *  huge afterwards.
+ */
+int oleole_alloc_guest_phy_huge(oleole_guest_system_t *gsys, unsigned long base)
+{
+	struct page *page;
+
+	if (gsys->guest_phy_mem_size < base + PMD_SIZE)
+		return -EINVAL;
+
+	if (!chunk_untouched(gsys, base))
+		return -EBUSY;	/* partly populated */
+
+	page = alloc_guest_frames(gsys, base, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_NORETRY,
+				  OLEOLE_GUEST_PHY_HUGE_ORDER);
+	if (!page)
+		return -ENOMEM;
+
+	/* keep every frame individually freeable */
+	split_page(page, OLEOLE_GUEST_PHY_HUGE_ORDER);
+
+	return publish_frames(gsys, base, page, OLEOLE_GUEST_PHY_HUGE_ORDER) ? -EBUSY : 0;
+}
+
+
+/*
+ *  Return the frames of [addr, addr + size) to demand-zero state.  The
+ *  caller has zapped every shadow of them and holds mmap_sem for
+ *  writing, so no fault can be using one.
+ */
+void oleole_release_guest_phy_memory(oleole_guest_system_t *gsys, unsigned long addr, unsigned long size)
+{
+	unsigned long s, pfn;
+	oleole_frame_table_t *table;
+
+	table = gsys->frames;
+
+	for (s = addr ; s < addr + size ; s += PAGE_SIZE) {
+		clear_bit(s >> PMD_SHIFT, table->huge_map);
+
+		pfn = xchg(&table->pfn[s >> PAGE_SHIFT], 0UL);
+		if (pfn)
+			oleole_frame_put(pfn_to_page(pfn));
 	}
+}
 
-	return ret;
 
-shrink:
-	for (s = new_size ; s < old_size ; s += PAGE_SIZE) {
-		int index;
-		unsigned long flags;
-		struct page *page;
+/****************************************************************************/
+/* Copy-on-write clones                                                     */
+/****************************************************************************/
+
+/*
+ *  A fork of a process running a guest gets a clone of its guest system.
+ *  Both frame tables then hold a reference on every frame, and the first
+ *  write on either side copies the frame (oleole_cow_guest_phy_page()).
+ *
+ *  Shared frames are only ever mapped read-only through the guest-
+ *  physical window, where a copy can find and zap the mapping.  Guest-
+ *  virtual faults break the sharing even for reads, since their aliases
+ *  could not be found without the reverse map.  2MB mappings are not
+ *  used once a guest system has been forked.
+ */
+oleole_guest_system_t *oleole_guest_system_clone(oleole_guest_system_t *gsys)
+{
+	unsigned long i, pfn;
+	oleole_guest_system_t *clone;
+	oleole_frame_table_t *table;
+
+	clone = oleole_guest_system_alloc();
+	if (!clone)
+		return NULL;
+
+	clone->fault_around_pages = gsys->fault_around_pages;
+	clone->cr3   = gsys->cr3;
+	spin_lock(&gsys->frame_lock);
+	clone->nodes = gsys->nodes;
+	spin_unlock(&gsys->frame_lock);
+
+	if (gsys->coherent) {
+		if (oleole_rmap_init(clone) < 0)
+			goto fail;
+		clone->coherent = 1;
+	}
+
+	if (gsys->frames) {
+		table = alloc_frame_table(gsys->frames->nr_frames);
+		if (!table)
+			goto fail;
+
+		for (i=0 ; i<table->nr_frames ; i++) {
+			pfn = gsys->frames->pfn[i];
+			if (!pfn)
+				continue;
+			get_page(pfn_to_page(pfn));
+			oleole_frame_get(pfn_to_page(pfn));
+			table->pfn[i] = pfn;
+		}
+
+		clone->frames = table;
+	}
+
+	clone->guest_phy_mem_size = gsys->guest_phy_mem_size;
+	clone->cow = 1;
+
+	return clone;
+
+fail:
+	oleole_guest_system_dealloc(clone);
+	return NULL;
+}
+
 
-		index = s / PAGE_SIZE;
+/*
+ *  Give guest frame addr a private copy of the shared frame old.  If
+ *  somebody else has replaced old meanwhile, nothing is done and the
+ *  caller looks the frame up again.
+ */
+int oleole_cow_guest_phy_page(oleole_guest_system_t *gsys, unsigned long addr, struct page *old)
+{
+	int won, pinned;
+	struct page *new;
+	oleole_frame_table_t *table;
+
+	/* pin old for the copy: a racing winner drops the table's hold on it */
+	spin_lock(&gsys->frame_lock);
+	rcu_read_lock();
+	table = rcu_dereference(gsys->frames);
+	pinned = (ACCESS_ONCE(table->pfn[addr >> PAGE_SHIFT]) == page_to_pfn(old));
+	if (pinned)
+		get_page(old);
+	rcu_read_unlock();
+	spin_unlock(&gsys->frame_lock);
+
+	if (!pinned)
+		return 0;
+
+	new = alloc_guest_frames(gsys, addr, GFP_KERNEL, 0);
+	if (!new) {
+		put_page(old);
+		return -ENOMEM;
+	}
+
+	copy_page(page_address(new), page_address(old));
+
+	smp_wmb();
 
-		spin_lock_irqsave(&guest_phy_page_table[index].lock, flags);
-		page = guest_phy_page_table[index].page;
-		guest_phy_page_table[index].page = NULL;
-		spin_unlock_irqrestore(&guest_phy_page_table[index].lock, flags);
+	spin_lock(&gsys->frame_lock);
 
-		if (page)
-			__free_page(page);
+	rcu_read_lock();
+	table = rcu_dereference(gsys->frames);
+	won = (cmpxchg(&table->pfn[addr >> PAGE_SHIFT], page_to_pfn(old), page_to_pfn(new)) ==
+	       page_to_pfn(old));
+	if (won) {
+		oleole_frame_get(new);
+		clear_bit(addr >> PMD_SHIFT, table->huge_map);
 	}
-	
-	return new_size;
+	rcu_read_unlock();
+
+	/* the read-only mapping of the shared frame */
+	if (won)
+		oleole_zap_guest_phy_range(gsys, addr & PAGE_MASK, PAGE_SIZE);
+
+	spin_unlock(&gsys->frame_lock);
+
+	if (won)
+		oleole_frame_put(old);
+	else
+		__free_page(new);
+
+	put_page(old);
+
+	return 0;
 }
 
 
-static int construct_system(void)
+/****************************************************************************/
+/* Eager population                                                         */
+/****************************************************************************/
+
+/*
+ *  OLEOLE_IOC_POPULATE backs the whole guest memory up front.  The range
+ *  is cut into one slice per online CPU and each slice is filled by a
+ *  work item bound to that CPU, so allocation and zeroing run in
+ *  parallel and frames come from the CPU's local node.  Zeroing uses
+ *  non-temporal stores: a freshly provisioned guest will not touch most
+ *  of its memory soon, and there is no point in flushing the caches
+ *  with gigabytes of zeros.
+ */
+typedef struct {
+	struct work_struct	work;
+	oleole_guest_system_t	*gsys;
+	struct task_struct	*task;		/* waiting in the ioctl */
+	unsigned long		start, end;
+	int			ret;
+} oleole_populate_work_t;
+
+
+static void clear_page_nocache(void *addr)
 {
+	unsigned long *p = addr;
 	int i;
-	const unsigned long size = sizeof(oleole_guest_phy_page_t) * OLEOLE_GUEST_PHY_MEMORY_PAGES;
 
-	guest_phy_page_table = vmalloc(size);
-	if (!guest_phy_page_table) {
-		printk("oleole: Can't allocate guset_phy_page_table.\n");
-		return -ENOMEM;		
-	}
+	for (i=0 ; i<PAGE_SIZE/sizeof(long) ; i+=8, p+=8)
+		asm volatile("movnti %1,   (%0)\n\t"
+			     "movnti %1,  8(%0)\n\t"
+			     "movnti %1, 16(%0)\n\t"
+			     "movnti %1, 24(%0)\n\t"
+			     "movnti %1, 32(%0)\n\t"
+			     "movnti %1, 40(%0)\n\t"
+			     "movnti %1, 48(%0)\n\t"
+			     "movnti %1, 56(%0)\n\t"
+			     : : "r" (p), "r" (0UL) : "memory");
+}
 
-	memset(guest_phy_page_table, 0, size);
 
-	for (i=0 ; i<OLEOLE_GUEST_PHY_MEMORY_PAGES ; i++)
-		spin_lock_init(&guest_phy_page_table[i].lock);
+static int populate_range(oleole_guest_system_t *gsys, struct task_struct *task,
+			  unsigned long start, unsigned long end)
+{
+	unsigned long s;
+	struct page *page;
+	int i;
+
+	for (s = start ; s < end ; ) {
+		/* the workers run for the ioctl: a kill of its caller stops them */
+		if (fatal_signal_pending(task))
+			return -EINTR;
+
+		if (!(s & ~PMD_MASK) && s + PMD_SIZE <= end && chunk_untouched(gsys, s)) {
+			page = alloc_guest_frames(gsys, s, GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY,
+						  OLEOLE_GUEST_PHY_HUGE_ORDER);
+			if (page) {
+				split_page(page, OLEOLE_GUEST_PHY_HUGE_ORDER);
+				for (i=0 ; i<(1 << OLEOLE_GUEST_PHY_HUGE_ORDER) ; i++)
+					clear_page_nocache(page_address(page + i));
+				/* order the non-temporal stores before publishing */
+				wmb();
+				publish_frames(gsys, s, page, OLEOLE_GUEST_PHY_HUGE_ORDER);
+				s += PMD_SIZE;
+				cond_resched();
+				continue;
+			}
+		}
+
+		if (!oleole_get_guest_phy_page(gsys, s)) {
+			page = alloc_guest_frames(gsys, s, GFP_KERNEL, 0);
+			if (!page)
+				return -ENOMEM;
+
+			clear_page_nocache(page_address(page));
+			wmb();
+			publish_frames(gsys, s, page, 0);
+		}
+
+		s += PAGE_SIZE;
+
+		cond_resched();
+	}
 
 	return 0;
 }
 
 
+static void populate_work(struct work_struct *work)
+{
+	oleole_populate_work_t *w = container_of(work, oleole_populate_work_t, work);
+
+	w->ret = populate_range(w->gsys, w->task, w->start, w->end);
+}
+
+
+int oleole_populate_guest_phy_memory(oleole_guest_system_t *gsys)
+{
+	int cpu, nr = 0, ret = 0;
+	unsigned long size, slice, s;
+	oleole_populate_work_t *works;
+
+	size = gsys->guest_phy_mem_size;
+	if (!size)
+		return 0;
+
+	works = kcalloc(nr_cpu_ids, sizeof(oleole_populate_work_t), GFP_KERNEL);
+	if (!works)
+		return -ENOMEM;
+
+	get_online_cpus();
+
+	slice = ALIGN(DIV_ROUND_UP(size, num_online_cpus()), PMD_SIZE);
+
+	s = 0;
+	for_each_online_cpu(cpu) {
+		oleole_populate_work_t *w;
+
+		if (size <= s)
+			break;
+
+		w = &works[nr++];
+
+		INIT_WORK(&w->work, populate_work);
+		w->gsys  = gsys;
+		w->task  = current;
+		w->start = s;
+		w->end   = min(s + slice, size);
+
+		schedule_work_on(cpu, &w->work);
+
+		s = w->end;
+	}
+
+	for (cpu=0 ; cpu<nr ; cpu++) {
+		flush_work(&works[cpu].work);
+		if (works[cpu].ret < 0)
+			ret = works[cpu].ret;
+	}
+
+	put_online_cpus();
+
+	kfree(works);
+
+	return ret;
+}
+
+
 static int __init oleole_init(void)
 {
 	int ret;
 
 	printk("oleole virtual memory installed\n");
 
+	ret = init_srcu_struct(&oleole_fault_srcu);
+	if (ret < 0)
+		return 0;
+
 	ret = oleole_create_procfile();
 	if (ret < 0)
 		return 0;
 
-	ret = construct_system();
+	ret = oleole_rmap_cache_init();
+	if (ret < 0)
+		return 0;
+
+	ret = oleole_pt_pool_init();
 	if (ret < 0)
 		return 0;
 
@@ -1,6 +1,16 @@
 #ifndef _ARCH_X86_OLEOLE_OLEOLE_INTERNAL_H
 #define _ARCH_X86_OLEOLE_OLEOLE_INTERNAL_H
 
+#include <linux/seqlock.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/nodemask.h>
+
+struct oleole_range;
+struct oleole_dirty_log;
+
 
 /* 
  *  Oleole VM mapping image
@@ -13,35 +23,307 @@
  */
 
 
+/* Number of PUD entries (1GB each) covering the 4GB guest-virtual window */
+#define OLEOLE_GUEST_VIRT_SIZE      (0x100000000UL)
+#define OLEOLE_GUEST_VIRT_PUDS      (OLEOLE_GUEST_VIRT_SIZE >> PUD_SHIFT)
+
+/* Shadow page-table page pool (per-CPU magazines and a global depot) */
+#define OLEOLE_PT_MAGAZINE_SIZE     (16)
+#define OLEOLE_PT_DEPOT_LOW         (256)
+#define OLEOLE_PT_DEPOT_MAX         (4096)
+
+/* Invalidations over this many pages flush the GTLB instead of page by page */
+#define OLEOLE_INVLPG_FLUSH_ALL     (32)
+
+/* Coherent mode reverse map */
+#define OLEOLE_RMAP_HASH_BITS       (12)
+#define OLEOLE_RMAP_MAX             (1UL << 20)
+
+/* Shadow roots cached per VM, and the shadow table pages they may hold */
+#define OLEOLE_SHADOW_ROOTS_MAX     (16)
+#define OLEOLE_SHADOW_PAGES_MAX     (16384)
+
+/* Number of shadow PTEs filled per guest-virtual fault (power of 2) */
+#define OLEOLE_FAULT_AROUND_DEFAULT (16)
+
+/* Windows looked up by the fault fast path, hashed by mm */
+#define OLEOLE_FAST_HASH_BITS       (6)
+
+
+/*
+ *  Guest TLB
+ *
+ *  Direct-mapped caches of segment-table entries (indexed by STI) and
+ *  page-table entries (indexed by VPN), both tagged with CR3.  Readers
+ *  are lockless under the seqlock; bumping gen invalidates everything.
+ *  stamp counts invalidations, see oleole_gtlb_stamp().
+ */
+#define OLEOLE_GTLB_STE_BITS (6)
+#define OLEOLE_GTLB_PTE_BITS (8)
+
+typedef struct {
+	uint32_t		gen;
+	uint32_t		cr3;
+	uint32_t		tag;
+	uint32_t		val;
+} oleole_gtlb_entry_t;
+
+typedef struct {
+	seqlock_t		seqlock;
+	uint32_t		gen;
+	unsigned int		stamp;
+	oleole_gtlb_entry_t	ste[1 << OLEOLE_GTLB_STE_BITS];
+	oleole_gtlb_entry_t	pte[1 << OLEOLE_GTLB_PTE_BITS];
+} oleole_gtlb_t;
+
+
+/*
+ *  Shadow root
+ *
+ *  The guest-virtual part of the shadow page table built for one CR3
+ *  value (STO and ASID).  The root of the running CR3 lives in the PUD
+ *  table itself; the others keep their PUD entries here.
+ */
+typedef struct {
+	struct list_head	lru;
+	uint32_t		key;
+	atomic_long_t		nr_pages;
+	struct list_head	rmap;
+	pud_t			pud[OLEOLE_GUEST_VIRT_PUDS];
+} oleole_shadow_root_t;
+
+
+/*
+ *  Guest physical frame table, one per guest system
+ *
+ *  Lookups are plain loads under RCU.  Frames are published and
+ *  replaced under frame_lock; resizing holds frames_mutex and takes
+ *  frame_lock to copy or clear the table.  Frames and replaced tables
+ *  are freed only after a grace period.
+ */
 typedef struct {
+	unsigned long		nr_frames;
+	unsigned long		*huge_map;  /* 2MB chunks backed by one order-9 block */
+	unsigned long		pfn[0];     /* guest frame -> host pfn, 0 if not backed */
+} oleole_frame_table_t;
+
+
+typedef struct oleole_guest_system {
 	spinlock_t		lock;
+	struct rcu_head		rcu;
+	struct rw_semaphore	fault_sem;  /* fast-path faults vs. flushes */
+	struct hlist_node	fast_link;  /* window lookup without mmap_sem */
+	struct mm_struct	*fast_mm;   /* NULL unless looked up */
+	unsigned long		fast_start;
+	unsigned long		fast_end;
 	unsigned int		initilized;
 	unsigned long		guest_phy_mem_size;
+	oleole_frame_table_t	*frames;
+	struct mutex		frames_mutex;
+	nodemask_t		nodes;      /* OLEOLE_IOC_NODEMASK (frame_lock), empty: mempolicy */
+	spinlock_t		frame_lock; /* replacing frames vs. mapping them */
+	unsigned int		cow;        /* frames may be shared with a fork */
+	struct list_head	clones;     /* guest systems forked off this one */
+	struct list_head	clone_link;
+	struct oleole_guest_system *origin; /* owner of the clones list */
+	struct mutex		dirty_mutex;
+	unsigned long		*dirty_bitmap;  /* NULL unless logging */
+	unsigned long		*dirty_spare;
+	unsigned long		dirty_frames;
 	uint32_t                cr3;
+	unsigned int		fault_around_pages;
 	struct vm_area_struct	*vma;
+	oleole_gtlb_t		gtlb;
+	struct mutex		shadow_mutex; /* CR3 switches and flushes */
+	atomic_t		shadow_seq;   /* see oleole_shadow_seq() */
+	struct list_head	roots;      /* LRU order, running root first */
+	unsigned int		nr_roots;
+	oleole_shadow_root_t	*cur_root;
+	unsigned int		coherent;
+	spinlock_t		rmap_lock;
+	struct hlist_head	*rmap_hash;
+	struct list_head	rmap_rootless;  /* entries made without a root */
+	unsigned long		nr_rmap;
+	unsigned long		*wp_frames;     /* write-protected table frames */
 } oleole_guest_system_t;
 
 
-typedef struct {
-	spinlock_t		lock;
-	struct page		*page;
-} oleole_guest_phy_page_t;
+/*
+ *  Faults on the window run with either mmap_sem or, on the fast path,
+ *  fault_sem held for reading.  Whatever must exclude them holds
+ *  mmap_sem for writing and takes fault_sem as well.
+ */
+static inline void oleole_lock_faults(oleole_guest_system_t *gsys, struct mm_struct *mm)
+{
+	down_write(&mm->mmap_sem);
+	down_write(&gsys->fault_sem);
+}
+
+static inline void oleole_unlock_faults(oleole_guest_system_t *gsys, struct mm_struct *mm)
+{
+	up_write(&gsys->fault_sem);
+	up_write(&mm->mmap_sem);
+}
+
+
+/*
+ *  Guest-virtual flushes, CR3 loads and INVLPG do not exclude faults.
+ *  A fault samples shadow_seq before it reads CR3 and the guest tables,
+ *  and gives up, to fault again, if it is odd or has moved by the time
+ *  the entry is stored under the table lock.  shadow_seq is odd while
+ *  the shadow is being changed under shadow_mutex, and is moved by two
+ *  on a write to a protected guest table.  Tables unlinked meanwhile are
+ *  freed once every fault is out of oleole_fault_srcu.
+ */
+extern struct srcu_struct oleole_fault_srcu;
+
+static inline int oleole_shadow_seq(oleole_guest_system_t *gsys)
+{
+	int seq = atomic_read(&gsys->shadow_seq);
+	smp_rmb();
+	return seq;
+}
+
+static inline int oleole_shadow_changed(oleole_guest_system_t *gsys, int seq)
+{
+	smp_rmb();
+	return (seq & 1) || atomic_read(&gsys->shadow_seq) != seq;
+}
+
+static inline void oleole_shadow_begin(oleole_guest_system_t *gsys)
+{
+	atomic_inc(&gsys->shadow_seq);
+	smp_mb__after_atomic_inc();
+}
+
+static inline void oleole_shadow_end(oleole_guest_system_t *gsys)
+{
+	smp_mb__before_atomic_inc();
+	atomic_inc(&gsys->shadow_seq);
+}
+
+static inline void oleole_shadow_invalidate(oleole_guest_system_t *gsys)
+{
+	atomic_add(2, &gsys->shadow_seq);
+	smp_mb();
+}
+
+
+static inline int oleole_is_virt_window(unsigned long address)
+{
+	return ((address & ~OLEOLETLB_PAGE_MASK) >> 32) == (OLEOLE_GUSET_VIRT_SPACE_OFFSET >> 32);
+}
+
 
 
-extern oleole_guest_phy_page_t *guest_phy_page_table;
+
+/*
+ *  Guest frames are never in the rmap, so _mapcount counts the frame
+ *  tables holding a frame instead.  Unlike the page count it is not
+ *  raised by get_user_pages() pins, which must not look like sharing.
+ */
+static inline void oleole_frame_get(struct page *page)
+{
+	atomic_inc(&page->_mapcount);
+}
+
+/* Drop a frame table's hold on page, freeing it with the last one */
+static inline void oleole_frame_put(struct page *page)
+{
+	atomic_dec(&page->_mapcount);
+	put_page(page);
+}
+
+/* A frame is shared with a fork while more than one frame table holds it */
+static inline int oleole_frame_shared(struct page *page)
+{
+	return page_mapcount(page) > 1;
+}
 
 
 extern oleole_guest_system_t *oleole_guest_system_alloc(void);
+extern oleole_guest_system_t *oleole_guest_system_clone(oleole_guest_system_t *gsys);
 extern void oleole_guest_system_dealloc(oleole_guest_system_t *gsys);
 
 extern int oleole_create_procfile(void);
 
 extern int oleole_get_gPTEInfo_offset(struct mm_struct *mm, pte_t **result, unsigned long address);
 extern int oleole_get_gPTE_offset_without_alloc(struct mm_struct *mm, pte_t **result, unsigned long address);
-extern int oleole_get_gPTE_offset_with_alloc(struct mm_struct *mm, pte_t **result, unsigned long address);
-extern unsigned long oleole_map_guest_phy_memory(unsigned long old_size, unsigned long new_size);
+extern int oleole_get_gPMD_offset_with_alloc(oleole_guest_system_t *gsys, struct mm_struct *mm, pmd_t **result, unsigned long address);
+extern int oleole_get_gPTE_offset_with_alloc(oleole_guest_system_t *gsys, struct mm_struct *mm, pte_t **result, spinlock_t **ptlp, unsigned long address);
+extern unsigned long oleole_map_guest_phy_memory(oleole_guest_system_t *gsys, unsigned long old_size, unsigned long new_size);
+extern struct page *oleole_get_guest_phy_page_ref(oleole_guest_system_t *gsys, unsigned long addr);
+extern struct page *oleole_alloc_guest_phy_page(oleole_guest_system_t *gsys, unsigned long addr);
+extern int oleole_alloc_guest_phy_huge(oleole_guest_system_t *gsys, unsigned long base);
+extern int oleole_populate_guest_phy_memory(oleole_guest_system_t *gsys);
+extern int oleole_cow_guest_phy_page(oleole_guest_system_t *gsys, unsigned long addr, struct page *old);
+extern void oleole_release_guest_phy_memory(oleole_guest_system_t *gsys, unsigned long addr, unsigned long size);
 extern int oleole_flush_guest_virt_memory(oleole_guest_system_t *gsys);
+extern int oleole_switch_guest_virt_memory(oleole_guest_system_t *gsys, uint32_t cr3);
+extern void oleole_free_shadow_roots(oleole_guest_system_t *gsys);
+extern int oleole_invalidate_guest_virt(oleole_guest_system_t *gsys, const struct oleole_range *ranges, unsigned int nr);
+extern int oleole_zap_guest_virt_range(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, uint32_t gva, unsigned long size);
+extern int oleole_wrprotect_guest_virt(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, uint32_t gva, uint32_t gfn);
+extern int oleole_wrprotect_guest_phy(oleole_guest_system_t *gsys, uint32_t gfn);
+extern void oleole_flush_tlb_all(oleole_guest_system_t *gsys);
+extern void oleole_flush_tlb_page(oleole_guest_system_t *gsys, unsigned long address);
+extern void oleole_zap_guest_phy_range(oleole_guest_system_t *gsys, unsigned long addr, unsigned long size);
+extern void oleole_flush_guest_virt_all(oleole_guest_system_t *gsys);
+extern void oleole_flush_guest_phy(oleole_guest_system_t *gsys);
+extern void oleole_wrprotect_guest_all(oleole_guest_system_t *gsys);
+extern void oleole_prefault(oleole_guest_system_t *gsys, struct vm_area_struct *vma, unsigned long start, unsigned long end);
+extern void oleole_fast_register(oleole_guest_system_t *gsys, struct vm_area_struct *vma);
+extern void oleole_fast_unregister(oleole_guest_system_t *gsys);
+extern struct page *oleole_get_guest_phy_page(oleole_guest_system_t *gsys, unsigned long addr);
+extern int oleole_guest_phy_huge(oleole_guest_system_t *gsys, unsigned long addr);
 extern int oleole_read_guest_phy_word(oleole_guest_system_t *gsys,uint32_t addr, uint32_t *result);
+extern int oleole_set_guest_phy_bits(oleole_guest_system_t *gsys, uint32_t addr, uint32_t bits, uint32_t *result);
+
+extern void oleole_gtlb_init(oleole_gtlb_t *gtlb);
+extern int oleole_gtlb_lookup_ste(oleole_gtlb_t *gtlb, uint32_t cr3, uint32_t sti, uint32_t *ste);
+extern int oleole_gtlb_lookup_pte(oleole_gtlb_t *gtlb, uint32_t cr3, uint32_t vpn, uint32_t *pte);
+extern unsigned int oleole_gtlb_stamp(oleole_gtlb_t *gtlb);
+extern void oleole_gtlb_insert_ste(oleole_gtlb_t *gtlb, unsigned int stamp, uint32_t cr3, uint32_t sti, uint32_t ste);
+extern void oleole_gtlb_insert_pte(oleole_gtlb_t *gtlb, unsigned int stamp, uint32_t cr3, uint32_t vpn, uint32_t pte);
+extern void oleole_gtlb_flush(oleole_gtlb_t *gtlb);
+extern void oleole_gtlb_flush_page(oleole_gtlb_t *gtlb, uint32_t cr3, uint32_t vaddr);
+
+extern int oleole_pt_pool_init(void);
+
+extern int oleole_rmap_cache_init(void);
+extern int oleole_rmap_init(oleole_guest_system_t *gsys);
+extern void oleole_rmap_destroy(oleole_guest_system_t *gsys);
+extern int oleole_frame_protected(oleole_guest_system_t *gsys, uint32_t gfn);
+extern int oleole_frames_protected(oleole_guest_system_t *gsys, uint32_t gfn, unsigned int nr);
+extern void oleole_rmap_track_table(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, uint32_t sto, uint32_t pto, uint32_t gva);
+extern void oleole_rmap_track_segment(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, uint32_t sto);
+extern void oleole_rmap_track_map(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, uint32_t gva, uint32_t gfn);
+extern int oleole_rmap_unprotect(oleole_guest_system_t *gsys, uint32_t gfn);
+extern void oleole_rmap_drop_root(oleole_guest_system_t *gsys, oleole_shadow_root_t *root);
+
+
+/* Dirty log */
+extern int oleole_dirty_log_enable(oleole_guest_system_t *gsys, int enable);
+extern int oleole_get_dirty_log(oleole_guest_system_t *gsys, const struct oleole_dirty_log *log);
+
+/*
+ *  Called by faults on guest frame gfn.  Returns non-zero if the
+ *  mapping must stay read-only so that the first write is logged.
+ */
+static inline int oleole_dirty_track(oleole_guest_system_t *gsys, unsigned long gfn, int write)
+{
+	unsigned long *bitmap = ACCESS_ONCE(gsys->dirty_bitmap);
+
+	if (!bitmap || gsys->dirty_frames <= gfn)
+		return 0;
+
+	if (write) {
+		set_bit(gfn, bitmap);
+		return 0;
+	}
+
+	return !test_bit(gfn, bitmap);
+}
 
 
 #endif  /* _ARCH_X86_OLEOLE_OLEOLE_INTERNAL_H */
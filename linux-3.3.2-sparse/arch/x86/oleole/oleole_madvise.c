@@ -0,0 +1,94 @@
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+
+#include <asm/tlbflush.h> /* for __flush_tlb() */
+
+#include <linux/oleole.h>
+#include <linux/oleoletlb.h>
+
+#include "oleole_internal.h"
+
+
+/*
+ *  MADV_WILLNEED on either window: prefault the shadow in bulk.
+ *  mmap_sem is held for reading.
+ */
+long oleolevm_madvise_willneed(struct vm_area_struct *vma,
+			       unsigned long start, unsigned long end)
+{
+	oleole_guest_system_t *gsys;
+
+	gsys = (oleole_guest_system_t *)vma->vm_private_data;
+	if (!gsys)
+		return -EINVAL;
+
+	oleole_prefault(gsys, vma, start, end);
+
+	return 0;
+}
+
+
+/*
+ *  MADV_DONTNEED on the guest-physical window: release the frames, which
+ *  read as zero again afterwards.
+ *
+ *  Guest-virtual shadows may map the frames through any CR3 and there is
+ *  no cheap way to find them without the reverse map, so every shadow is
+ *  thrown away; deactivating them would leave the freed frames to
+ *  get_user_pages_fast().  That has to exclude faults, so mmap_sem is dropped and
+ *  taken for writing, with fault_sem; the caller is told so, as with
+ *  MADV_REMOVE.
+ *
+ *  A clone's guest system goes away with its vma, so while mmap_sem is
+ *  not held gsys may be freed: the vma is looked up again and gsys only
+ *  used if it is still the one behind start.
+ */
+long oleolevm_madvise_dontneed(struct vm_area_struct *vma,
+			       unsigned long start, unsigned long end)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	oleole_guest_system_t *gsys;
+	unsigned long addr, size;
+
+	gsys = (oleole_guest_system_t *)vma->vm_private_data;
+	if (!gsys)
+		return -EINVAL;
+
+	addr = start - vma->vm_start;
+	if ((addr >> 32) != (OLEOLE_GUSET_PHY_SPACE_OFFSET >> 32))
+		return -EINVAL;	/* only guest memory can be given back */
+
+	up_read(&mm->mmap_sem);
+	down_write(&mm->mmap_sem);
+
+	vma = find_vma(mm, start);
+	if (!vma || start < vma->vm_start || vma->vm_private_data != gsys ||
+	    start - vma->vm_start != addr) {
+		/* unmapped or replaced meanwhile */
+		up_write(&mm->mmap_sem);
+		down_read(&mm->mmap_sem);
+		return -EINVAL;
+	}
+
+	down_write(&gsys->fault_sem);
+
+	if (gsys->guest_phy_mem_size <= addr)
+		goto out;
+
+	size = min(end - start, gsys->guest_phy_mem_size - addr);
+
+	/* the frames read as zero from now on */
+	if (gsys->dirty_bitmap)
+		bitmap_set(gsys->dirty_bitmap, addr >> PAGE_SHIFT, size >> PAGE_SHIFT);
+
+	oleole_zap_guest_phy_range(gsys, addr, size);
+	oleole_flush_guest_virt_all(gsys);
+	oleole_release_guest_phy_memory(gsys, addr, size);
+
+out:
+	oleole_unlock_faults(gsys, mm);
+	down_read(&mm->mmap_sem);
+
+	return 0;
+}
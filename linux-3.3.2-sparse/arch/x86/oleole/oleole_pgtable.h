@@ -6,6 +6,8 @@
 #include <asm/pgtable.h>
 #include <asm/pgtable_types.h>
 
+struct mmu_gather;
+
 
 #define _PAGE_BIT_DEACTIVATED (50)
 #define _PAGE_DEACTIVATED     (_AC(1,UL) << _PAGE_BIT_DEACTIVATED)
@@ -14,21 +16,97 @@
 			 _PAGE_DIRTY)
 
 
-static inline void oleole_pgd_populate(pgd_t *pgd, pud_t *pud)
+/* oleole_pool.c */
+extern struct page *oleole_pt_alloc(void);
+extern void oleole_pt_free(struct page *page);
+extern void oleole_pt_free_tlb(struct mmu_gather *tlb, struct page *page);
+
+
+/*
+ *  Occupancy summary
+ *
+ *  page->index of a shadow PMD or PTE table has one bit for each group
+ *  of OLEOLE_OCC_GROUP consecutive entries.  The bit is set before an
+ *  entry of the group is installed and only cleared when the pool hands
+ *  the table out again, so scans skip the groups whose bit is clear and
+ *  cost what the guest actually touched.
+ */
+#define OLEOLE_OCC_GROUP	(PTRS_PER_PTE / BITS_PER_LONG)
+
+static inline void oleole_occ_mark(void *entry)
+{
+	unsigned long *occ = &virt_to_page(entry)->index;
+	unsigned int group = ((unsigned long)entry & ~PAGE_MASK) / (sizeof(pte_t) * OLEOLE_OCC_GROUP);
+
+	if (!test_bit(group, occ))
+		set_bit(group, occ);
+}
+
+static inline unsigned long oleole_occ(void *table)
+{
+	return ACCESS_ONCE(virt_to_page(table)->index);
+}
+
+/* i if its group is occupied, else the first entry of the next one */
+static inline unsigned int oleole_occ_next(unsigned long occ, unsigned int i)
+{
+	unsigned int group = i / OLEOLE_OCC_GROUP;
+
+	if (BITS_PER_LONG <= group)
+		return PTRS_PER_PTE;
+	if (occ & (1UL << group))
+		return i;
+
+	return find_next_bit(&occ, BITS_PER_LONG, group + 1) * OLEOLE_OCC_GROUP;
+}
+
+#define oleole_for_each_occupied(i, occ)				\
+	for ((i) = oleole_occ_next(occ, 0) ; (i) < PTRS_PER_PTE ;	\
+	     (i) = oleole_occ_next(occ, (i) + 1))
+
+
+/*
+ *  Tables are installed with cmpxchg against an empty entry, so that
+ *  threads faulting concurrently do not need a lock to extend the tree.
+ *  Returns 0 if the entry was still empty.
+ */
+static inline int oleole_pud_populate(pud_t *pud, pmd_t *pmd)
 {
-	*pgd = __pgd(_PAGE_TABLE | __pa(pud));
+	return cmpxchg(&pud->pud, 0UL, _PAGE_TABLE | __pa(pmd)) != 0;
 }
 
-static inline void oleole_pud_populate(pud_t *pud, pmd_t *pmd)
+static inline int oleole_pmd_populate(pmd_t *pmd, pte_t *pte)
 {
-	*pud = __pud(_PAGE_TABLE | __pa(pmd));
+	oleole_occ_mark(pmd);
+	return cmpxchg(&pmd->pmd, 0UL, _PAGE_TABLE | __pa(pte)) != 0;
 }
 
-static inline void oleole_pmd_populate(pmd_t *pmd, pte_t *pte)
+
+/*
+ *  Split table locks
+ *
+ *  The entries of a shadow PMD or PTE table are updated under the lock
+ *  kept in the struct page of the table, like the split PTE locks of the
+ *  kernel, or mm->page_table_lock without USE_SPLIT_PTLOCKS.  Faults on
+ *  different tables run in parallel.  Lock order:
+ *  frame_lock -> rmap_lock -> table lock.
+ */
+static inline spinlock_t *oleole_table_lockptr(struct mm_struct *mm, void *table)
 {
-	*pmd = __pmd(_PAGE_TABLE | __pa(pte));
+#if USE_SPLIT_PTLOCKS
+	(void)mm;
+	return __pte_lockptr(virt_to_page(table));
+#else
+	return &mm->page_table_lock;
+#endif
 }
 
+#define oleole_pmd_lockptr(mm, pud) \
+	oleole_table_lockptr(mm, oleole_pmd_offset(pud, 0))
+
+#define oleole_pte_lockptr(mm, pmd) \
+	oleole_table_lockptr(mm, oleole_pte_offset(pmd, 0))
+
 
 /**/
 static inline int oleole_pgd_bad(pgd_t pgd)
@@ -126,26 +204,17 @@ static inline int oleole_pmd_none_or_clear_bad(pmd_t *pmd)
 }
 
 
-static inline int oleole_pud_alloc(pgd_t *pgd)
-{
-	struct page *page;
-	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-	if (unlikely(page == NULL)) {
-		return -ENOMEM;
-	}
-	oleole_pgd_populate(pgd, (pud_t*)page_address(page));
-	return 0;
-}
-
-
 static inline int oleole_pmd_alloc(pud_t *pud)
 {
 	struct page *page;
-	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	page = oleole_pt_alloc();
 	if (unlikely(page == NULL)) {
 		return -ENOMEM;
 	}
-	oleole_pud_populate(pud, (pmd_t*)page_address(page));
+	if (oleole_pud_populate(pud, (pmd_t*)page_address(page))) {
+		oleole_pt_free(page);	/* another thread was first */
+		return 1;
+	}
 	return 0;
 }
 
@@ -153,11 +222,14 @@ static inline int oleole_pmd_alloc(pud_t *pud)
 static inline int oleole_pte_alloc(pmd_t *pmd)
 {
 	struct page *page;
-	page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	page = oleole_pt_alloc();
 	if (unlikely(page == NULL)) {
 		return -ENOMEM;
 	}
-	oleole_pmd_populate(pmd, (pte_t*)page_address(page));
+	if (oleole_pmd_populate(pmd, (pte_t*)page_address(page))) {
+		oleole_pt_free(page);	/* another thread was first */
+		return 1;
+	}
 	return 0;
 }
 
@@ -0,0 +1,195 @@
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include <asm/tlb.h>
+
+#include <linux/oleole.h>
+#include <linux/oleoletlb.h>
+
+#include "oleole_internal.h"
+#include "oleole_pgtable.h"
+
+
+/*
+ *  Shadow page-table page pool
+ *
+ *  Table pages are taken from a per-CPU magazine of zeroed pages.  An
+ *  empty magazine is refilled from the global depot.  Freed tables are
+ *  queued on the dirty list; a work item zeroes them and puts them back
+ *  into the depot, and keeps the depot above its low watermark, so the
+ *  fault path neither enters the buddy allocator nor clears pages.
+ *  Tables torn down with the VMA go back to the buddy allocator through
+ *  the mmu_gather batch instead, after the TLB flush.
+ */
+
+typedef struct {
+	unsigned int		nr;
+	struct page		*pages[OLEOLE_PT_MAGAZINE_SIZE];
+} oleole_pt_magazine_t;
+
+
+static DEFINE_PER_CPU(oleole_pt_magazine_t, oleole_pt_magazines);
+
+static DEFINE_SPINLOCK(depot_lock);
+static LIST_HEAD(depot_list);		/* zeroed pages */
+static unsigned long depot_nr;
+
+static DEFINE_SPINLOCK(dirty_lock);
+static LIST_HEAD(dirty_list);		/* pages to be zeroed */
+static unsigned long dirty_nr;
+
+
+static void pool_work_fn(struct work_struct *work);
+static DECLARE_WORK(pool_work, pool_work_fn);
+
+
+/****************************************************************************/
+/*                                                                          */
+/****************************************************************************/
+
+static void refill_magazine(oleole_pt_magazine_t *mag)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&depot_lock, flags);
+	while (mag->nr < OLEOLE_PT_MAGAZINE_SIZE / 2 && depot_nr) {
+		struct page *page;
+
+		page = list_first_entry(&depot_list, struct page, lru);
+		list_del(&page->lru);
+		depot_nr--;
+
+		mag->pages[mag->nr++] = page;
+	}
+	spin_unlock_irqrestore(&depot_lock, flags);
+}
+
+
+struct page *oleole_pt_alloc(void)
+{
+	struct page *page = NULL;
+	oleole_pt_magazine_t *mag;
+
+	mag = &get_cpu_var(oleole_pt_magazines);
+
+	if (unlikely(!mag->nr))
+		refill_magazine(mag);
+
+	if (likely(mag->nr))
+		page = mag->pages[--mag->nr];
+
+	put_cpu_var(oleole_pt_magazines);
+
+	if (ACCESS_ONCE(depot_nr) < OLEOLE_PT_DEPOT_LOW)
+		schedule_work(&pool_work);
+
+	if (unlikely(!page))
+		page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+
+	if (likely(page)) {
+		pte_lock_init(page);
+		page->index = 0;	/* nothing occupied */
+	}
+
+	return page;
+}
+
+
+void oleole_pt_free(struct page *page)
+{
+	unsigned long flags;
+	int queued = 0;
+
+	pte_lock_deinit(page);
+
+	spin_lock_irqsave(&dirty_lock, flags);
+	if (dirty_nr < OLEOLE_PT_DEPOT_MAX) {
+		list_add(&page->lru, &dirty_list);
+		dirty_nr++;
+		queued = 1;
+	}
+	spin_unlock_irqrestore(&dirty_lock, flags);
+
+	if (queued)
+		schedule_work(&pool_work);
+	else
+		__free_page(page);
+}
+
+
+/* Free page with the other pages of tlb, once the TLBs are flushed */
+void oleole_pt_free_tlb(struct mmu_gather *tlb, struct page *page)
+{
+	pte_lock_deinit(page);
+	tlb_remove_page(tlb, page);
+}
+
+
+/****************************************************************************/
+/* Background zeroing                                                       */
+/****************************************************************************/
+
+static void put_depot(struct page *page)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&depot_lock, flags);
+	if (depot_nr < OLEOLE_PT_DEPOT_MAX) {
+		list_add(&page->lru, &depot_list);
+		depot_nr++;
+		page = NULL;
+	}
+	spin_unlock_irqrestore(&depot_lock, flags);
+
+	if (page)
+		__free_page(page);
+}
+
+
+static void pool_work_fn(struct work_struct *work)
+{
+	for (;;) {
+		unsigned long flags;
+		struct page *page = NULL;
+
+		spin_lock_irqsave(&dirty_lock, flags);
+		if (dirty_nr) {
+			page = list_first_entry(&dirty_list, struct page, lru);
+			list_del(&page->lru);
+			dirty_nr--;
+		}
+		spin_unlock_irqrestore(&dirty_lock, flags);
+
+		if (!page)
+			break;
+
+		clear_page(page_address(page));
+		put_depot(page);
+
+		cond_resched();
+	}
+
+	while (ACCESS_ONCE(depot_nr) < OLEOLE_PT_DEPOT_LOW) {
+		struct page *page;
+
+		page = alloc_page(GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN);
+		if (!page)
+			break;
+
+		put_depot(page);
+
+		cond_resched();
+	}
+}
+
+
+int oleole_pt_pool_init(void)
+{
+	schedule_work(&pool_work);
+
+	return 0;
+}
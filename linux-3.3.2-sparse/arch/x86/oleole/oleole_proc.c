@@ -1,5 +1,6 @@
 #include <linux/init.h>
 #include <linux/mm.h>
+#include <linux/sched.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/uaccess.h>
@@ -15,6 +16,9 @@ static struct proc_dir_entry *oleolevm_proc_entry;
 
 
 
+static struct vm_operations_struct oleolevm_vm_ops;
+
+
 static int oleolevm_open(struct inode *inode, struct file *file)
 {
 	file->private_data = oleole_guest_system_alloc();
@@ -36,12 +40,15 @@ static int oleolevm_release(struct inode *inode, struct file *file)
 
 	file->private_data = NULL;
 
+	/* every clone holds a reference on the file through its vma */
+	WARN_ON(!list_empty(&gsys->clones));
+
 	spin_lock_irqsave(&gsys->lock, flags);
 	size = gsys->guest_phy_mem_size;
 	gsys->guest_phy_mem_size = 0;
 	spin_unlock_irqrestore(&gsys->lock, flags);
 	
-	oleole_map_guest_phy_memory(size, 0);
+	oleole_map_guest_phy_memory(gsys, size, 0);
 
 	oleole_guest_system_dealloc(gsys);
 
@@ -73,11 +80,14 @@ static int oleolevm_mmap(struct file *file, struct vm_area_struct *vma)
 		return -EINVAL;
 	
 	/*
-	 *  - VM_DONTCOPY   Don't copy on fork
 	 *  - VM_DONTEXPAND Can't expand with mremap.
 	 *  - VM_RESERVED   Can't unmap
+	 *
+	 *  A fork gets a copy-on-write clone of the guest, see
+	 *  oleolevm_copy_page_range().
 	 */
-	vma->vm_flags |= VM_OLEOLETLB | VM_DONTCOPY | VM_DONTEXPAND| VM_RESERVED;
+	vma->vm_flags |= VM_OLEOLETLB | VM_DONTEXPAND| VM_RESERVED;
+	vma->vm_ops = &oleolevm_vm_ops;
 
 	spin_lock_irqsave(&vm_info->lock, flags);	
 	vm_info->vma = vma;
@@ -85,10 +95,145 @@ static int oleolevm_mmap(struct file *file, struct vm_area_struct *vma)
 		vma->vm_private_data = vm_info;
 	spin_unlock_irqrestore(&vm_info->lock, flags);
 
+	if (vma->vm_private_data == vm_info)
+		oleole_fast_register(vm_info, vma);
+
+	return 0;
+}
+
+
+/*
+ *  fork(): give the child's copy of the window its own guest system,
+ *  sharing the frames copy-on-write.  Called with the parent's mmap_sem
+ *  held for writing, after the child's vma has been linked.
+ */
+int oleolevm_copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
+			     struct vm_area_struct *vma)
+{
+	unsigned long flags;
+	struct vm_area_struct *dst_vma;
+	oleole_guest_system_t *gsys, *clone, *origin;
+
+	dst_vma = find_vma(dst_mm, vma->vm_start);
+	BUG_ON(!dst_vma || dst_vma->vm_start != vma->vm_start);
+
+	/* until the clone exists, the child must not touch the parent */
+	dst_vma->vm_private_data = NULL;
+
+	gsys = (oleole_guest_system_t *)vma->vm_private_data;
+	if (!gsys)
+		return 0;
+
+	/* the parent's fast-path faults must not change what is copied */
+	down_write(&gsys->fault_sem);
+
+	clone = oleole_guest_system_clone(gsys);
+	if (!clone) {
+		up_write(&gsys->fault_sem);
+		return -ENOMEM;
+	}
+
+	clone->vma = dst_vma;
+	dst_vma->vm_private_data = clone;
+	oleole_fast_register(clone, dst_vma);
+
+	origin = gsys->origin ? gsys->origin : gsys;
+
+	spin_lock_irqsave(&origin->lock, flags);
+	clone->origin = origin;
+	list_add(&clone->clone_link, &origin->clones);
+	spin_unlock_irqrestore(&origin->lock, flags);
+
+	/* from now on the parent's frames are shared, too */
+	gsys->cow = 1;
+
+	if (gsys->vma) {
+		/* writable leaves would let gup-fast write the child's frames */
+		oleole_flush_guest_phy(gsys);
+		oleole_flush_guest_virt_all(gsys);
+	}
+
+	up_write(&gsys->fault_sem);
+
 	return 0;
 }
 
 
+/*
+ *  Other code changing the vma under mmap_sem excludes the fast path
+ *  with these.
+ */
+void oleolevm_lock_faults(struct vm_area_struct *vma)
+{
+	oleole_guest_system_t *gsys = vma->vm_private_data;
+
+	if (gsys)
+		down_write(&gsys->fault_sem);
+}
+
+
+void oleolevm_unlock_faults(struct vm_area_struct *vma)
+{
+	oleole_guest_system_t *gsys = vma->vm_private_data;
+
+	if (gsys)
+		up_write(&gsys->fault_sem);
+}
+
+
+static void oleolevm_vm_close(struct vm_area_struct *vma)
+{
+	unsigned long flags;
+	oleole_guest_system_t *gsys, *origin;
+
+	gsys = (oleole_guest_system_t *)vma->vm_private_data;
+	vma->vm_private_data = NULL;
+
+	if (!gsys || !gsys->origin)
+		return;		/* owned by the file */
+
+	origin = gsys->origin;
+
+	spin_lock_irqsave(&origin->lock, flags);
+	list_del(&gsys->clone_link);
+	spin_unlock_irqrestore(&origin->lock, flags);
+
+	oleole_map_guest_phy_memory(gsys, gsys->guest_phy_mem_size, 0);
+
+	oleole_guest_system_dealloc(gsys);
+}
+
+
+static struct vm_operations_struct oleolevm_vm_ops = {
+	.close		= oleolevm_vm_close,
+};
+
+
+/*
+ *  The guest system an ioctl applies to: the file's own, or the clone
+ *  the calling process got by forking.
+ */
+static oleole_guest_system_t *current_guest_system(oleole_guest_system_t *gsys)
+{
+	unsigned long flags;
+	oleole_guest_system_t *clone, *found = gsys;
+
+	if (list_empty(&gsys->clones) || (gsys->vma && gsys->vma->vm_mm == current->mm))
+		return gsys;
+
+	spin_lock_irqsave(&gsys->lock, flags);
+	list_for_each_entry(clone, &gsys->clones, clone_link) {
+		if (clone->vma && clone->vma->vm_mm == current->mm) {
+			found = clone;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&gsys->lock, flags);
+
+	return found;
+}
+
+
 static long oleolevm_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	int ret = -EINVAL;
@@ -101,6 +246,8 @@ static long oleolevm_ioctl(struct file *file, unsigned int cmd, unsigned long ar
 	if (!gsys)
 		return -ENODEV;
 
+	gsys = current_guest_system(gsys);
+
 	switch(cmd) {
 
 	case OLEOLE_IOC_START: {
@@ -118,14 +265,16 @@ static long oleolevm_ioctl(struct file *file, unsigned int cmd, unsigned long ar
 
 		spin_lock_irqsave(&gsys->lock, flags);
 		mapping = (gsys->vma != NULL);
-		if (mapping)
-			gsys->guest_phy_mem_size = size;
+		old_guest_phy_mem_size = gsys->guest_phy_mem_size;
 		spin_unlock_irqrestore(&gsys->lock, flags);
 
 		if (mapping)
 			return -EBUSY; 
 
-		cur_phy_mem_size = oleole_map_guest_phy_memory(old_guest_phy_mem_size, size);
+		if (gsys->dirty_bitmap)
+			return -EBUSY; /* the log is sized to the memory */
+
+		cur_phy_mem_size = oleole_map_guest_phy_memory(gsys, old_guest_phy_mem_size, size);
 
 		spin_lock_irqsave(&gsys->lock, flags);
 		gsys->guest_phy_mem_size = cur_phy_mem_size;
@@ -137,18 +286,153 @@ static long oleolevm_ioctl(struct file *file, unsigned int cmd, unsigned long ar
 		return 0;
 	}
 
+	case OLEOLE_IOC_POPULATE: {
+		int mapping;
+		unsigned long flags;
+
+		spin_lock_irqsave(&gsys->lock, flags);
+		mapping = (gsys->vma != NULL);
+		spin_unlock_irqrestore(&gsys->lock, flags);
+
+		if (mapping)
+			return -EBUSY; /* faults populate a mapped guest */
+
+		return oleole_populate_guest_phy_memory(gsys);
+	}
+
+	case OLEOLE_IOC_NODEMASK: {
+		__u64 mask = arg;
+		nodemask_t nodes;
+		int nid;
+
+		nodes_clear(nodes);
+		for (nid=0 ; nid<64 ; nid++) {
+			if (!(mask & (1ULL << nid)))
+				continue;
+			if (nid >= MAX_NUMNODES || !node_online(nid))
+				return -EINVAL;
+			node_set(nid, nodes);
+		}
+
+		/* 0 goes back to the memory policy */
+		spin_lock(&gsys->frame_lock);
+		gsys->nodes = nodes;
+		spin_unlock(&gsys->frame_lock);
+
+		return 0;
+	}
+
+	case OLEOLE_IOC_DIRTY_LOG: {
+		__u32 enable = arg;
+
+		return oleole_dirty_log_enable(gsys, !!enable);
+	}
+
+	case OLEOLE_IOC_GET_DIRTY_LOG: {
+		struct oleole_dirty_log log;
+
+		if (copy_from_user(&log, argp, sizeof(log)))
+			return -EFAULT;
+
+		return oleole_get_dirty_log(gsys, &log);
+	}
+
 	case OLEOLE_IOC_SETCR3: {
 		__u32 cr3 = arg;
-		unsigned long flags;
 
-		if (cr3 & ~PAGE_MASK)
+		if (cr3 & ~(OLEOLE_CR3_STO_MASK | OLEOLE_CR3_NOFLUSH | OLEOLE_CR3_ASID_MASK))
 			return -EINVAL; /* missaligment */
 
+		if (!(cr3 & OLEOLE_CR3_NOFLUSH))
+			oleole_gtlb_flush(&gsys->gtlb);
+
+		/* loads gsys->cr3 too, with the shadow */
+		return oleole_switch_guest_virt_memory(gsys, cr3);
+	}
+
+	case OLEOLE_IOC_FAULT_AROUND: {
+		__u32 pages = arg;
+		unsigned long flags;
+
+		if (pages == 0)
+			pages = 1;
+
+		if (PTRS_PER_PTE < pages || (pages & (pages - 1)))
+			return -EINVAL; /* power of 2 within one shadow PTE table */
+
+		spin_lock_irqsave(&gsys->lock, flags);
+		gsys->fault_around_pages = pages;
+		spin_unlock_irqrestore(&gsys->lock, flags);
+
+		return 0;
+	}
+
+	case OLEOLE_IOC_COHERENT: {
+		__u32 enable = arg;
+		unsigned long flags;
+		int mapping;
+
 		spin_lock_irqsave(&gsys->lock, flags);
-		gsys->cr3 = cr3;
+		mapping = (gsys->vma != NULL);
 		spin_unlock_irqrestore(&gsys->lock, flags);
 
-		oleole_flush_guest_virt_memory(gsys);
+		if (mapping)
+			return -EBUSY; /* must be chosen before mmap */
+
+		if (enable && !gsys->rmap_hash) {
+			ret = oleole_rmap_init(gsys);
+			if (ret < 0)
+				return ret;
+		}
+
+		gsys->coherent = !!enable;
+
+		return 0;
+	}
+
+	case OLEOLE_IOC_INVLPG: {
+		struct oleole_range range;
+
+		range.start = (__u32)arg & PAGE_MASK;
+		range.pages = 1;
+
+		if (oleole_invalidate_guest_virt(gsys, &range, 1))
+			return -EINVAL;
+
+		return 0;
+	}
+
+	case OLEOLE_IOC_INVLPG_VEC: {
+		struct oleole_invlpg_vec vec;
+		struct oleole_range ranges[32];
+		struct oleole_range __user *uranges;
+		unsigned int i, done, nr;
+
+		if (copy_from_user(&vec, argp, sizeof(vec)))
+			return -EFAULT;
+
+		if (vec.flags)
+			return -EINVAL;
+
+		uranges = (struct oleole_range __user *)(unsigned long)vec.ranges;
+
+		for (done = 0 ; done < vec.count ; done += nr) {
+			nr = min_t(unsigned int, vec.count - done, ARRAY_SIZE(ranges));
+
+			if (copy_from_user(ranges, uranges + done, nr * sizeof(ranges[0])))
+				return -EFAULT;
+
+			for (i=0 ; i<nr ; i++) {
+				if (ranges[i].start & ~PAGE_MASK)
+					return -EINVAL; /* missaligment */
+				if (OLEOLE_GUEST_VIRT_SIZE - ranges[i].start <
+				    (unsigned long)(ranges[i].pages ? ranges[i].pages : 1) * PAGE_SIZE)
+					return -EINVAL; /* beyond 4GB */
+			}
+
+			if (oleole_invalidate_guest_virt(gsys, ranges, nr))
+				return -EINVAL;
+		}
 
 		return 0;
 	}
@@ -162,17 +446,221 @@ static long oleolevm_ioctl(struct file *file, unsigned int cmd, unsigned long ar
 }
 
 
+/****************************************************************************/
+/* read/write                                                               */
+/****************************************************************************/
+
+/*
+ *  The file reads and writes the guest-physical space; untouched frames
+ *  read as zeros.  readv/writev, splice and sendfile all end up here.
+ *
+ *  If the guest is mapped, its mmap_sem is held for reading while a
+ *  frame is looked up, which keeps MADV_DONTNEED and shadow table
+ *  teardown away just as for faults.  The copy itself runs with only a
+ *  reference on the frame: the caller is usually the guest process, and
+ *  a fault on its buffer would take mmap_sem again behind a writer.
+ */
+static struct mm_struct *get_guest_mm(oleole_guest_system_t *gsys)
+{
+	unsigned long flags;
+	struct mm_struct *mm = NULL;
+
+	spin_lock_irqsave(&gsys->lock, flags);
+	if (gsys->vma && atomic_inc_not_zero(&gsys->vma->vm_mm->mm_users))
+		mm = gsys->vma->vm_mm;
+	spin_unlock_irqrestore(&gsys->lock, flags);
+
+	if (mm)
+		down_read(&mm->mmap_sem);
+
+	return mm;
+}
+
+
+static void put_guest_mm(struct mm_struct *mm)
+{
+	if (!mm)
+		return;
+
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+}
+
+
+static ssize_t oleolevm_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+	oleole_guest_system_t *gsys;
+	struct mm_struct *mm;
+	unsigned long pos, size;
+	ssize_t done = 0;
+
+	gsys = (oleole_guest_system_t *)file->private_data;
+	if (!gsys)
+		return -ENODEV;
+
+	gsys = current_guest_system(gsys);
+
+	size = gsys->guest_phy_mem_size;
+	pos  = *ppos;
+
+	while ((size_t)done < count && pos < size) {
+		struct page *page;
+		unsigned long n, left;
+
+		n = min_t(unsigned long, PAGE_SIZE - (pos & ~PAGE_MASK), count - done);
+		n = min(n, size - pos);
+
+		mm = get_guest_mm(gsys);
+		page = oleole_get_guest_phy_page_ref(gsys, pos);
+		put_guest_mm(mm);
+
+		if (page) {
+			left = copy_to_user(buf + done, page_address(page) + (pos & ~PAGE_MASK), n);
+			put_page(page);
+		} else {
+			left = clear_user(buf + done, n);
+		}
+
+		if (left) {
+			if (!done)
+				done = -EFAULT;
+			break;
+		}
+
+		done += n;
+		pos  += n;
+
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+
+	if (done > 0)
+		*ppos = pos;
+
+	return done;
+}
+
+
+static ssize_t oleolevm_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	oleole_guest_system_t *gsys;
+	struct mm_struct *mm;
+	unsigned long pos, size;
+	ssize_t done = 0, err = 0;
+	int dirty_locked = 0;
+
+	gsys = (oleole_guest_system_t *)file->private_data;
+	if (!gsys)
+		return -ENODEV;
+
+	gsys = current_guest_system(gsys);
+
+	size = gsys->guest_phy_mem_size;
+	pos  = *ppos;
+
+	if (count && size <= pos)
+		err = -ENOSPC;
+
+	while (!err && (size_t)done < count && pos < size) {
+		struct page *page;
+		unsigned long n, gfn;
+
+		n = min_t(unsigned long, PAGE_SIZE - (pos & ~PAGE_MASK), count - done);
+		n = min(n, size - pos);
+
+		gfn = pos >> PAGE_SHIFT;
+
+		mm = get_guest_mm(gsys);
+
+		/*
+		 *  Without a mapping no fault lock keeps the dirty log stable.
+		 *  dirty_mutex goes before mmap_sem, so it is kept to the end.
+		 */
+		if (!mm && !dirty_locked) {
+			mutex_lock(&gsys->dirty_mutex);
+			dirty_locked = 1;
+			continue;
+		}
+
+		page = oleole_get_guest_phy_page_ref(gsys, pos);
+		if (!page) {
+			if (!oleole_alloc_guest_phy_page(gsys, pos))
+				err = -ENOMEM;
+			put_guest_mm(mm);
+			continue;
+		}
+
+		if (gsys->cow && oleole_frame_shared(page)) {
+			err = oleole_cow_guest_phy_page(gsys, pos, page);
+			put_page(page);
+			put_guest_mm(mm);
+			continue;
+		}
+
+		/* a GET_DIRTY_LOG before the copy logs the pinned frame again */
+		oleole_dirty_track(gsys, gfn, 1);
+
+		put_guest_mm(mm);
+
+		if (copy_from_user(page_address(page) + (pos & ~PAGE_MASK), buf + done, n))
+			err = -EFAULT;
+
+		/*
+		 *  Unprotect after the copy: a fault during it may protect the
+		 *  frame again and shadow the old contents.
+		 */
+		mm = get_guest_mm(gsys);
+		if (mm && oleole_frame_protected(gsys, gfn))
+			oleole_rmap_unprotect(gsys, gfn);
+		put_guest_mm(mm);
+
+		put_page(page);
+
+		if (err)
+			break;
+
+		done += n;
+		pos  += n;
+
+		if (fatal_signal_pending(current))
+			break;
+		cond_resched();
+	}
+
+	if (dirty_locked)
+		mutex_unlock(&gsys->dirty_mutex);
+
+	if (!done)
+		return err;
+
+	*ppos = pos;
+
+	return done;
+}
+
+
 static loff_t oleolevm_lseek(struct file *file, loff_t offset, int orig)
 {
 	loff_t retval = -EINVAL;
+	oleole_guest_system_t *gsys;
 
 	switch (orig) {
+	case SEEK_END: /* 2 */
+		gsys = (oleole_guest_system_t *)file->private_data;
+		if (!gsys)
+			break;
+		offset += current_guest_system(gsys)->guest_phy_mem_size;
+		goto set;
+
 	case SEEK_CUR: /* 1 */
 		offset += file->f_pos;
 		/* fallthrough */
 
 	case SEEK_SET: /* 0 */
-		if (offset < 0 || offset > MAX_NON_LFS)
+	set:
+		/* the guest-physical space is 4GB */
+		if (offset < 0 || offset > (OLEOLE_GUEST_PHY_MEMORY_PAGES << PAGE_SHIFT))
 			break;
 
 		file->f_pos = retval = offset;
@@ -186,6 +674,8 @@ static loff_t oleolevm_lseek(struct file *file, loff_t offset, int orig)
 static struct file_operations oleolevm_proc_ops = {
 	.open           = oleolevm_open,
 	.mmap           = oleolevm_mmap,
+	.read           = oleolevm_read,
+	.write          = oleolevm_write,
 	.llseek         = oleolevm_lseek,
 	.unlocked_ioctl = oleolevm_ioctl,
 	.release        = oleolevm_release,
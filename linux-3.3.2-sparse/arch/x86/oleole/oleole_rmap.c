@@ -0,0 +1,388 @@
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/vmalloc.h>
+
+#include <linux/oleole.h>
+#include <linux/oleoletlb.h>
+
+#include "oleole_internal.h"
+
+
+/*
+ *  Coherent shadow mode
+ *
+ *  Every guest frame read as a segment table or a page table is
+ *  write-protected in both windows.  The reverse map records, per
+ *  guest frame,
+ *
+ *    OLEOLE_RMAP_PT  : the guest segments translated by this page table
+ *    OLEOLE_RMAP_MAP : the guest-virtual pages mapping this frame
+ *
+ *  A segment table is found through the CR3 key of its shadow root, so
+ *  it has no entries of its own.  A write trap on a protected frame
+ *  zaps the shadow entries derived from it and lifts the protection
+ *  until the frame is walked again.
+ *
+ *  rmap_lock is taken with interrupts disabled, so TLB shootdowns are
+ *  only noted under it and sent once it is released.
+ */
+
+enum {
+	OLEOLE_RMAP_PT,
+	OLEOLE_RMAP_MAP,
+};
+
+typedef struct {
+	struct hlist_node	hash;
+	struct list_head	list;		/* per shadow root */
+	oleole_shadow_root_t	*root;
+	uint32_t		gfn;
+	uint32_t		gva;
+	unsigned int		kind;
+} oleole_rmap_t;
+
+
+static struct kmem_cache *oleole_rmap_cache;
+
+
+static int protect_frame(oleole_guest_system_t *gsys, uint32_t gfn);
+static void drop_root_locked(oleole_guest_system_t *gsys, oleole_shadow_root_t *root);
+static int reset_locked(oleole_guest_system_t *gsys);
+
+
+int oleole_rmap_cache_init(void)
+{
+	oleole_rmap_cache = kmem_cache_create("oleole_rmap", sizeof(oleole_rmap_t), 0, 0, NULL);
+	if (!oleole_rmap_cache)
+		return -ENOMEM;
+
+	return 0;
+}
+
+
+int oleole_rmap_init(oleole_guest_system_t *gsys)
+{
+	gsys->rmap_hash = vzalloc(sizeof(struct hlist_head) << OLEOLE_RMAP_HASH_BITS);
+	if (!gsys->rmap_hash)
+		return -ENOMEM;
+
+	gsys->wp_frames = vzalloc(BITS_TO_LONGS(OLEOLE_GUEST_PHY_MEMORY_PAGES) * sizeof(long));
+	if (!gsys->wp_frames) {
+		vfree(gsys->rmap_hash);
+		gsys->rmap_hash = NULL;
+		return -ENOMEM;
+	}
+
+	gsys->nr_rmap = 0;
+
+	return 0;
+}
+
+
+void oleole_rmap_destroy(oleole_guest_system_t *gsys)
+{
+	int flush = 0;
+	unsigned long flags;
+
+	if (!gsys->rmap_hash)
+		return;
+
+	spin_lock_irqsave(&gsys->rmap_lock, flags);
+	if (reset_locked(gsys))
+		flush = 1;
+	spin_unlock_irqrestore(&gsys->rmap_lock, flags);
+
+	if (flush)
+		oleole_flush_tlb_all(gsys);
+
+	vfree(gsys->wp_frames);
+	vfree(gsys->rmap_hash);
+	gsys->wp_frames = NULL;
+	gsys->rmap_hash = NULL;
+}
+
+
+static inline struct hlist_head *rmap_bucket(oleole_guest_system_t *gsys, uint32_t gfn)
+{
+	return &gsys->rmap_hash[hash_32(gfn, OLEOLE_RMAP_HASH_BITS)];
+}
+
+
+static inline struct list_head *root_rmap_list(oleole_guest_system_t *gsys, oleole_shadow_root_t *root)
+{
+	return root ? &root->rmap : &gsys->rmap_rootless;
+}
+
+
+static void free_rmap(oleole_guest_system_t *gsys, oleole_rmap_t *rmap)
+{
+	hlist_del(&rmap->hash);
+	list_del(&rmap->list);
+	kmem_cache_free(oleole_rmap_cache, rmap);
+	gsys->nr_rmap--;
+}
+
+
+/* Caller has made room */
+static void add_locked(oleole_guest_system_t *gsys, oleole_shadow_root_t *root,
+		       unsigned int kind, uint32_t gfn, uint32_t gva)
+{
+	oleole_rmap_t *rmap;
+	struct hlist_node *pos;
+	struct hlist_head *head;
+
+	head = rmap_bucket(gsys, gfn);
+
+	hlist_for_each_entry(rmap, pos, head, hash)
+		if (rmap->gfn == gfn && rmap->gva == gva &&
+		    rmap->kind == kind && rmap->root == root)
+			return;
+
+	rmap = kmem_cache_alloc(oleole_rmap_cache, GFP_ATOMIC);
+	if (!rmap)
+		return;
+
+	rmap->root = root;
+	rmap->gfn  = gfn;
+	rmap->gva  = gva;
+	rmap->kind = kind;
+
+	hlist_add_head(&rmap->hash, head);
+	list_add(&rmap->list, root_rmap_list(gsys, root));
+	gsys->nr_rmap++;
+}
+
+
+/*
+ *  Out of entries: start over.  Done before any frame is protected for
+ *  the new entry, as the reset lifts every protection.  Returns 1 if the
+ *  TLBs must be flushed.
+ */
+static int make_room_locked(oleole_guest_system_t *gsys)
+{
+	if (likely(gsys->nr_rmap < OLEOLE_RMAP_MAX))
+		return 0;
+
+	return reset_locked(gsys);
+}
+
+
+/****************************************************************************/
+/* Tracking                                                                 */
+/****************************************************************************/
+
+int oleole_frame_protected(oleole_guest_system_t *gsys, uint32_t gfn)
+{
+	return gsys->coherent && test_bit(gfn, gsys->wp_frames);
+}
+
+
+int oleole_frames_protected(oleole_guest_system_t *gsys, uint32_t gfn, unsigned int nr)
+{
+	return gsys->coherent && find_next_bit(gsys->wp_frames, gfn + nr, gfn) < gfn + nr;
+}
+
+
+/*
+ *  Record that the shadow of guest-virtual address gva in root was
+ *  built from segment table sto and page table pto.
+ */
+void oleole_rmap_track_table(oleole_guest_system_t *gsys, oleole_shadow_root_t *root,
+			     uint32_t sto, uint32_t pto, uint32_t gva)
+{
+	int flush = 0;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gsys->rmap_lock, flags);
+
+	flush |= make_room_locked(gsys);
+	flush |= protect_frame(gsys, sto >> PAGE_SHIFT);
+	flush |= protect_frame(gsys, pto >> PAGE_SHIFT);
+
+	add_locked(gsys, root, OLEOLE_RMAP_PT, pto >> PAGE_SHIFT, gva & OLEOLE_SEGMENT_MASK);
+
+	spin_unlock_irqrestore(&gsys->rmap_lock, flags);
+
+	if (flush)
+		oleole_flush_tlb_all(gsys);
+}
+
+
+/*
+ *  Same for a large segment, which only depends on segment table sto.
+ */
+void oleole_rmap_track_segment(oleole_guest_system_t *gsys, oleole_shadow_root_t *root,
+			       uint32_t sto)
+{
+	int flush;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gsys->rmap_lock, flags);
+	flush = protect_frame(gsys, sto >> PAGE_SHIFT);
+	spin_unlock_irqrestore(&gsys->rmap_lock, flags);
+
+	if (flush)
+		oleole_flush_tlb_all(gsys);
+}
+
+
+/*
+ *  Record that guest-virtual page gva in root maps guest frame gfn.
+ */
+void oleole_rmap_track_map(oleole_guest_system_t *gsys, oleole_shadow_root_t *root,
+			   uint32_t gva, uint32_t gfn)
+{
+	int flush;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gsys->rmap_lock, flags);
+	flush = make_room_locked(gsys);
+	add_locked(gsys, root, OLEOLE_RMAP_MAP, gfn, gva & PAGE_MASK);
+	spin_unlock_irqrestore(&gsys->rmap_lock, flags);
+
+	if (flush)
+		oleole_flush_tlb_all(gsys);
+}
+
+
+/* Caller holds rmap_lock.  Returns 1 if the TLBs must be flushed */
+static int protect_frame(oleole_guest_system_t *gsys, uint32_t gfn)
+{
+	int flush;
+	oleole_rmap_t *rmap;
+	struct hlist_node *pos;
+
+	if (__test_and_set_bit(gfn, gsys->wp_frames))
+		return 0;
+
+	flush = oleole_wrprotect_guest_phy(gsys, gfn);
+
+	hlist_for_each_entry(rmap, pos, rmap_bucket(gsys, gfn), hash) {
+		if (rmap->gfn != gfn || rmap->kind != OLEOLE_RMAP_MAP)
+			continue;
+
+		flush |= oleole_wrprotect_guest_virt(gsys, rmap->root, rmap->gva, gfn);
+	}
+
+	return flush;
+}
+
+
+/*
+ *  The guest writes to protected frame gfn: zap every shadow entry that
+ *  was derived from it and let the write through.  Returns 1 if the
+ *  protection was lifted here, which moves shadow_seq by two.
+ */
+int oleole_rmap_unprotect(oleole_guest_system_t *gsys, uint32_t gfn)
+{
+	int flush = 0, lifted = 0;
+	unsigned long flags;
+	oleole_rmap_t *rmap;
+	oleole_shadow_root_t *root, *next;
+	struct hlist_node *pos, *tmp;
+
+	spin_lock_irqsave(&gsys->rmap_lock, flags);
+
+	if (!__test_and_clear_bit(gfn, gsys->wp_frames))
+		goto out;
+
+	/* faults that read the frame before the write start over */
+	oleole_shadow_invalidate(gsys);
+	lifted = 1;
+
+	/* page table: the segments it translates */
+	hlist_for_each_entry_safe(rmap, pos, tmp, rmap_bucket(gsys, gfn), hash) {
+		if (rmap->gfn != gfn || rmap->kind != OLEOLE_RMAP_PT)
+			continue;
+
+		flush |= oleole_zap_guest_virt_range(gsys, rmap->root, rmap->gva,
+						     OLEOLE_SEGMENT_SIZE);
+		free_rmap(gsys, rmap);
+	}
+
+	/* segment table: every address space rooted at it */
+	if (gsys->cur_root == NULL && (gsys->cr3 & OLEOLE_CR3_STO_MASK) >> PAGE_SHIFT == gfn) {
+		flush |= oleole_zap_guest_virt_range(gsys, NULL, 0, OLEOLE_GUEST_VIRT_SIZE);
+		drop_root_locked(gsys, NULL);
+	}
+
+	list_for_each_entry_safe(root, next, &gsys->roots, lru) {
+		if ((root->key & OLEOLE_CR3_STO_MASK) >> PAGE_SHIFT != gfn)
+			continue;
+
+		flush |= oleole_zap_guest_virt_range(gsys, root, 0, OLEOLE_GUEST_VIRT_SIZE);
+		drop_root_locked(gsys, root);
+	}
+
+	oleole_gtlb_flush(&gsys->gtlb);
+
+out:
+	spin_unlock_irqrestore(&gsys->rmap_lock, flags);
+
+	if (flush)
+		oleole_flush_tlb_all(gsys);
+
+	return lifted;
+}
+
+
+/****************************************************************************/
+/* Dropping                                                                 */
+/****************************************************************************/
+
+static void drop_root_locked(oleole_guest_system_t *gsys, oleole_shadow_root_t *root)
+{
+	oleole_rmap_t *rmap, *next;
+
+	list_for_each_entry_safe(rmap, next, root_rmap_list(gsys, root), list)
+		free_rmap(gsys, rmap);
+}
+
+
+/*
+ *  The shadow of root has been thrown away.
+ */
+void oleole_rmap_drop_root(oleole_guest_system_t *gsys, oleole_shadow_root_t *root)
+{
+	unsigned long flags;
+
+	if (!gsys->rmap_hash)
+		return;
+
+	spin_lock_irqsave(&gsys->rmap_lock, flags);
+	drop_root_locked(gsys, root);
+	spin_unlock_irqrestore(&gsys->rmap_lock, flags);
+}
+
+
+/*
+ *  Out of entries: zap every guest-virtual shadow and start over.
+ *  Returns 1 if the TLBs must be flushed.
+ */
+static int reset_locked(oleole_guest_system_t *gsys)
+{
+	int flush = 0;
+	oleole_shadow_root_t *root;
+
+	if (gsys->vma) {
+		/* faults that tracked nothing yet would not be zapped */
+		oleole_shadow_invalidate(gsys);
+		oleole_zap_guest_virt_range(gsys, gsys->cur_root, 0, OLEOLE_GUEST_VIRT_SIZE);
+		list_for_each_entry(root, &gsys->roots, lru)
+			if (root != gsys->cur_root)
+				oleole_zap_guest_virt_range(gsys, root, 0, OLEOLE_GUEST_VIRT_SIZE);
+		flush = 1;
+	}
+
+	drop_root_locked(gsys, NULL);
+	list_for_each_entry(root, &gsys->roots, lru)
+		drop_root_locked(gsys, root);
+
+	/* nothing depends on the protected frames any more */
+	bitmap_zero(gsys->wp_frames, OLEOLE_GUEST_PHY_MEMORY_PAGES);
+
+	oleole_gtlb_flush(&gsys->gtlb);
+
+	return flush;
+}
@@ -1,7 +1,13 @@
 #include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/workqueue.h>
 
 #include <linux/oleole.h>
 #include <linux/oleoletlb.h>
+#include <linux/oleole_ioctl.h>
 
 #include <asm/tlb.h>
 
@@ -11,8 +17,41 @@
 
 static void reactivate_pmd_table(pud_t *pud);
 static void reactivate_pte_table(pmd_t *pmd);
+static void free_pmd_range(pmd_t *pmd, struct mmu_gather *tlb);
 
 
+static inline void account_shadow_table(oleole_guest_system_t *gsys, unsigned long address)
+{
+	oleole_shadow_root_t *root = gsys->cur_root;
+
+	if (root && oleole_is_virt_window(address))
+		atomic_long_inc(&root->nr_pages);
+}
+
+
+
+
+/*
+ *  TLB shootdown of the shadow on every CPU the guest runs on.  These
+ *  send IPIs, so never call them with interrupts disabled, e.g. under
+ *  rmap_lock.
+ */
+void oleole_flush_tlb_all(oleole_guest_system_t *gsys)
+{
+	struct vm_area_struct *vma = ACCESS_ONCE(gsys->vma);
+
+	if (vma)
+		flush_tlb_mm(vma->vm_mm);
+}
+
+
+void oleole_flush_tlb_page(oleole_guest_system_t *gsys, unsigned long address)
+{
+	struct vm_area_struct *vma = ACCESS_ONCE(gsys->vma);
+
+	if (vma)
+		flush_tlb_page(vma, address);
+}
 
 
 /****************************************************************************/
@@ -36,14 +75,14 @@ int oleole_get_gPTEInfo_offset(struct mm_struct *mm, pte_t **result, unsigned lo
 	pud_v = *pud;
 
 	if (oleole_pud_none(pud_v))
-		if (oleole_pmd_alloc(pud))
+		if (oleole_pmd_alloc(pud) < 0)
 			return -ENOMEM;
 
 	pmd   = pmd_offset(pud, address);
 	pmd_v = *pmd;
 
 	if (oleole_pmd_none(pmd_v))
-		if (oleole_pte_alloc(pmd))
+		if (oleole_pte_alloc(pmd) < 0)
 			return -ENOMEM;
 
 	pte  = pte_offset_map(pmd, address);
@@ -83,12 +122,16 @@ int oleole_get_gPTE_offset_without_alloc(struct mm_struct *mm, pte_t **result, u
 }
 
 
-int oleole_get_gPTE_offset_with_alloc(struct mm_struct *mm, pte_t **result, unsigned long address)
+/*
+ *  The walkers below run with mmap_sem or fault_sem held for reading,
+ *  in many threads at once.  Missing tables are installed with cmpxchg,
+ *  and a deactivated table is reactivated under its own lock.
+ */
+int oleole_get_gPMD_offset_with_alloc(oleole_guest_system_t *gsys, struct mm_struct *mm, pmd_t **result, unsigned long address)
 {
+	int ret;
 	pgd_t *pgd, pgd_v;
 	pud_t *pud, pud_v;
-	pmd_t *pmd, pmd_v;
-	pte_t *pte;
 
 	pgd   = pgd_offset(mm, address);
 	pgd_v = *pgd;
@@ -99,24 +142,74 @@ int oleole_get_gPTE_offset_with_alloc(struct mm_struct *mm, pte_t **result, unsi
 	pud   = pud_offset(pgd, address);
 	pud_v = *pud;
 
-	if (oleole_pud_none(pud_v))
-		if (oleole_pmd_alloc(pud))
+	if (oleole_pud_none(pud_v)) {
+		ret = oleole_pmd_alloc(pud);
+		if (ret < 0)
 			return -ENOMEM;
+		if (ret == 0)
+			account_shadow_table(gsys, address);
+		pud_v = *pud;
+	}
 
-	if (unlikely((pud_val(pud_v) & _PAGE_DEACTIVATED)))
-		reactivate_pmd_table(pud);
+	if (unlikely((pud_val(pud_v) & _PAGE_DEACTIVATED))) {
+		spinlock_t *ptl = oleole_pmd_lockptr(mm, pud);
+
+		spin_lock(ptl);
+		if (pud_val(*pud) & _PAGE_DEACTIVATED)
+			reactivate_pmd_table(pud);
+		spin_unlock(ptl);
+	}
+
+	*result = oleole_pmd_offset(pud, address);
+
+	return 0;
+}
+
+
+/*
+ *  Returns the shadow PTE of address and, through ptlp, the lock that
+ *  the caller takes to update it.
+ */
+int oleole_get_gPTE_offset_with_alloc(oleole_guest_system_t *gsys, struct mm_struct *mm, pte_t **result, spinlock_t **ptlp, unsigned long address)
+{
+	int ret;
+	pmd_t *pmd, pmd_v;
+	pte_t *pte;
+
+	ret = oleole_get_gPMD_offset_with_alloc(gsys, mm, &pmd, address);
+	if (ret < 0)
+		return ret;
 
-	pmd   = pmd_offset(pud, address);
 	pmd_v = *pmd;
 
-	if (oleole_pmd_none(pmd_v))
-		if (oleole_pte_alloc(pmd))
+	if (unlikely(pmd_large(pmd_v))) {
+		/* a 2MB mapping being split */
+		if (cmpxchg(&pmd->pmd, pmd_val(pmd_v), 0UL) == pmd_val(pmd_v))
+			oleole_flush_tlb_page(gsys, address & PMD_MASK);
+		pmd_v = *pmd;
+	}
+
+	if (oleole_pmd_none(pmd_v)) {
+		ret = oleole_pte_alloc(pmd);
+		if (ret < 0)
 			return -ENOMEM;
+		if (ret == 0)
+			account_shadow_table(gsys, address);
+		pmd_v = *pmd;
+		if (unlikely(pmd_large(pmd_v)))
+			return -EAGAIN;	/* lost to a 2MB mapping */
+	}
 
-	if (unlikely((pmd_val(pmd_v) & _PAGE_DEACTIVATED)))
-		reactivate_pte_table(pmd);
+	*ptlp = oleole_pte_lockptr(mm, pmd);
 
-	pte  = pte_offset_map(pmd, address);
+	if (unlikely((pmd_val(pmd_v) & _PAGE_DEACTIVATED))) {
+		spin_lock(*ptlp);
+		if (pmd_val(*pmd) & _PAGE_DEACTIVATED)
+			reactivate_pte_table(pmd);
+		spin_unlock(*ptlp);
+	}
+
+	pte  = oleole_pte_offset(pmd, address);
 
 	*result = pte;
 
@@ -124,51 +217,64 @@ int oleole_get_gPTE_offset_with_alloc(struct mm_struct *mm, pte_t **result, unsi
 }
 
 
+/*
+ *  Lazy flush
+ *
+ *  A flush only sets _PAGE_DEACTIVATED in the PUD entries of the
+ *  guest-virtual window.  The bit is reserved for the MMU, so the next
+ *  access to a deactivated subtree raises #PF with PF_RSVD.  The fault
+ *  path then clears the bit one level at a time and pushes it down to
+ *  the populated entries below, so tables are recycled instead of being
+ *  freed and allocated again.  A deactivated PTE is simply rebuilt.
+ *  Reactivation holds the lock of the table below the entry; the bits
+ *  are set atomically since entries may be installed with cmpxchg
+ *  meanwhile.
+ */
 static void reactivate_pmd_table(pud_t *pud)
 {
-	int i;
+	unsigned int i;
+	unsigned long occ;
 	pmd_t *pmd;
-	unsigned long val;
-
-	val  = pud_val(*pud);
 
-	if (likely(val & ~(_PAGE_DEACTIVATED|_PAGE_PRESENT)))
-		val &= ~_PAGE_DEACTIVATED;
-	else
-		val &= ~(_PAGE_DEACTIVATED|_PAGE_PRESENT);
-
-	*pud = __pud(val);
-
-	pmd = pmd_offset(pud, 0);
-	for (i=0 ; i<PTRS_PER_PMD ; i++, pmd++) {
-		val  = pmd_val(*pmd);
-		val |= (_PAGE_DEACTIVATED|_PAGE_PRESENT);
-		*pmd = __pmd(val);
+	pmd = oleole_pmd_offset(pud, 0);
+	occ = oleole_occ(pmd);
+	oleole_for_each_occupied(i, occ) {
+		if (oleole_pmd_none(pmd[i]))
+			continue;
+		set_bit(_PAGE_BIT_DEACTIVATED, (unsigned long *)&pmd[i].pmd);
 	}
+
+	clear_bit(_PAGE_BIT_DEACTIVATED, (unsigned long *)&pud->pud);
 }
 
 
 static void reactivate_pte_table(pmd_t *pmd)
 {
-	int i;
+	unsigned int i;
+	unsigned long occ;
 	pte_t *pte;
-	unsigned long val;
 
-	val  = pmd_val(*pmd);
+	pte = oleole_pte_offset(pmd, 0);
+	occ = oleole_occ(pte);
+	oleole_for_each_occupied(i, occ) {
+		if (oleole_pte_none(pte[i]))
+			continue;
+		pte[i] = __pte(pte_val(pte[i]) | _PAGE_DEACTIVATED);
+	}
 
-	if (likely(val & ~(_PAGE_DEACTIVATED|_PAGE_PRESENT)))
-		val &= ~_PAGE_DEACTIVATED;
-	else
-		val &= ~(_PAGE_DEACTIVATED|_PAGE_PRESENT);
+	clear_bit(_PAGE_BIT_DEACTIVATED, (unsigned long *)&pmd->pmd);
+}
 
-	*pmd = __pmd(val);
-	
-	/* PTEs */
-	pte = pte_offset_map(pmd, 0);
-	for (i=0 ; i<PTRS_PER_PTE ; i++, pte++) {
-		val  = pte_val(*pte);
-		val |= (_PAGE_DEACTIVATED|_PAGE_PRESENT);
-		*pte = __pte(val);
+
+/* Faults may be reactivating the entries meanwhile */
+static void deactivate_pud(pud_t *pud)
+{
+	int i;
+
+	for (i=0 ; i<OLEOLE_GUEST_VIRT_PUDS ; i++, pud++) {
+		if (oleole_pud_none(*pud))
+			continue;
+		set_bit(_PAGE_BIT_DEACTIVATED, (unsigned long *)&pud->pud);
 	}
 }
 
@@ -176,43 +282,126 @@ static void reactivate_pte_table(pmd_t *pmd)
 /****************************************************************************/
 /* Deallocate Shadow Page Table                                             */
 /****************************************************************************/
-static void free_pmd_range(pud_t *pud)
+
+/*
+ *  Shadow tables are never freed while anything may still walk them:
+ *  neither the MMU of another CPU nor a lockless walker such as
+ *  get_user_pages_fast(), nor a fault in flight.  Tables torn down with
+ *  the VMA go through the mmu_gather batch tlb, which frees them after
+ *  the TLB flush; tables unlinked from a live VMA go on a dead list
+ *  (see below).  A NULL tlb frees at once, for tables nothing can reach.
+ */
+static void free_table(struct page *page, struct mmu_gather *tlb)
 {
-	int i;
-	pmd_t *pmd;
-	pmd = pmd_offset(pud, 0);
+	if (tlb)
+		oleole_pt_free_tlb(tlb, page);
+	else
+		oleole_pt_free(page);
+}
 
-	for (i=0 ; i<PTRS_PER_PMD ; i++, pmd++) {
+
+/* Free the PTE tables referenced by the PMD table at base */
+static void free_pmd_range(pmd_t *base, struct mmu_gather *tlb)
+{
+	unsigned int i;
+	unsigned long occ;
+
+	occ = oleole_occ(base);
+	oleole_for_each_occupied(i, occ) {
+		pmd_t *pmd = &base[i];
 		struct page *page;
 
+		if (pmd_large(*pmd)) {
+			/* maps guest memory, not a table */
+			pmd_clear(pmd);
+			continue;
+		}
+
 		if (oleole_pmd_none_or_clear_bad(pmd))
 			continue;
 
 		page = pmd_page(*pmd);
-		__free_page(page);
+		free_table(page, tlb);
 		pmd_clear(pmd);		
 	}
 }
 
 
-static void free_pud_range(pgd_t *pgd)
+/* Free the PMD table referenced by *pud and everything below it */
+static void free_pmd_table(pud_t *pud, struct mmu_gather *tlb)
+{
+	pmd_t *pmd;
+
+	pmd = oleole_pmd_offset(pud, 0);
+	free_pmd_range(pmd, tlb);
+	free_table(virt_to_page(pmd), tlb);
+}
+
+
+/*
+ *  Deferred freeing
+ *
+ *  A PMD table unlinked by a flush may still be walked by faults in
+ *  flight, which can even hang new PTE tables below it.  Such tables are
+ *  collected on a dead list, which is handed over after the TLB flush,
+ *  and freed with everything below them once those faults have left
+ *  oleole_fault_srcu and walkers running with interrupts disabled are
+ *  done as well.
+ */
+static DEFINE_SPINLOCK(dead_lock);
+static LIST_HEAD(dead_tables);
+
+static void dead_work_fn(struct work_struct *work);
+static DECLARE_WORK(dead_work, dead_work_fn);
+
+
+static void free_dead_tables(struct list_head *dead)
+{
+	if (list_empty(dead))
+		return;
+
+	spin_lock(&dead_lock);
+	list_splice_init(dead, &dead_tables);
+	spin_unlock(&dead_lock);
+
+	schedule_work(&dead_work);
+}
+
+
+static void dead_work_fn(struct work_struct *work)
+{
+	struct page *page, *next;
+	LIST_HEAD(pages);
+
+	spin_lock(&dead_lock);
+	list_splice_init(&dead_tables, &pages);
+	spin_unlock(&dead_lock);
+
+	if (list_empty(&pages))
+		return;
+
+	synchronize_srcu(&oleole_fault_srcu);
+	synchronize_sched();
+
+	list_for_each_entry_safe(page, next, &pages, lru) {
+		list_del(&page->lru);
+		free_pmd_range((pmd_t *)page_address(page), NULL);
+		oleole_pt_free(page);
+	}
+}
+
+
+static void free_pud_range(struct mmu_gather *tlb, pgd_t *pgd)
 {
 	int i;
 	pud_t *pud;
 	pud = pud_offset(pgd, 0);
 
 	for (i=0 ; i<PTRS_PER_PUD ; i++, pud++) {
-		pmd_t *pmd;
-		struct page *page;
-
 		if (oleole_pud_none_or_clear_bad(pud))
 			continue;
 
-		free_pmd_range(pud);
-
-		pmd = pmd_offset(pud, 0);
-		page = virt_to_page(pmd);
-		__free_page(page);
+		free_pmd_table(pud, tlb);
 		pud_clear(pud);
 	}
 }
@@ -227,33 +416,39 @@ void oleolevm_free_pgd_range(struct mmu_gather *tlb,
 	unsigned long flags;
 	oleole_guest_system_t *gsys;
 
-	addr &= PMD_MASK;
+	/* fast-path faults hold fault_sem, not mmap_sem */
+	gsys = vma->vm_private_data;
+	if (gsys) {
+		down_write(&gsys->fault_sem);
+		oleole_fast_unregister(gsys);
+	}
 
-	for ( ; addr < end ; addr += PMD_SIZE) {
+	/* the window spans whole PGD entries: visit each once */
+	for ( ; addr < end ; addr = pgd_addr_end(addr, end)) {
 		pgd_t *pgd;
 		pud_t *pud;
-		struct page *page;
 
 		pgd = pgd_offset(tlb->mm, addr);
 
 		if (oleole_pgd_none_or_clear_bad(pgd))
 			continue;
 
-		free_pud_range(pgd);
+		free_pud_range(tlb, pgd);
 
 		pud = pud_offset(pgd, 0);
-		page = virt_to_page(pud);
-		__free_page(page);
 		pgd_clear(pgd);
+		pud_free_tlb(tlb, pud, addr);
 	}
 
-	/* */
-	gsys = vma->vm_private_data;
 	if (gsys) {
+		oleole_free_shadow_roots(gsys);
+
+		/* vm_private_data stays for oleolevm_vm_close() */
 		spin_lock_irqsave(&gsys->lock, flags);
-		vma->vm_private_data = NULL;
 		gsys->vma = NULL;
 		spin_unlock_irqrestore(&gsys->lock, flags);
+
+		up_write(&gsys->fault_sem);
 	}
 
 	tlb->need_flush = 1;
@@ -264,86 +459,948 @@ void oleolevm_free_pgd_range(struct mmu_gather *tlb,
 /*                                                                          */
 /****************************************************************************/
 
-int oleole_flush_guest_virt_memory(oleole_guest_system_t *gsys)
+/*
+ *  Returns the first of the OLEOLE_GUEST_VIRT_PUDS live PUD entries that
+ *  cover the guest-virtual window, or NULL if nothing was ever mapped.
+ */
+static pud_t *guest_virt_pud(struct vm_area_struct *vma)
 {
-	unsigned long flags;
-	unsigned long start, end;
-	struct vm_area_struct	*vma;
-	struct mm_struct *mm;
+	unsigned long start;
 	pgd_t *pgd;
 
+	start = vma->vm_start + OLEOLE_GUSET_VIRT_SPACE_OFFSET;
+
+	pgd = pgd_offset(vma->vm_mm, start);
+	if (!pgd_present(*pgd))
+		return NULL;
+
+	return pud_offset(pgd, start);
+}
+
+
+/* Put the PMD table referenced by an unlinked PUD entry on dead */
+static void bury_pmd_table(pud_t pud, struct list_head *dead)
+{
+	if (oleole_pud_none_or_clear_bad(&pud))
+		return;
+
+	list_add(&virt_to_page(oleole_pmd_offset(&pud, 0))->lru, dead);
+}
+
+
+/*
+ *  Unlink the OLEOLE_GUEST_VIRT_PUDS entries at pud, 4GB of either
+ *  window, and free the tables below them.  The reverse map walks the entries under rmap_lock, see
+ *  root_pud().
+ */
+static void free_pud_entries(oleole_guest_system_t *gsys, pud_t *pud, struct list_head *dead)
+{
+	int i;
+	unsigned long flags;
+	pud_t old[OLEOLE_GUEST_VIRT_PUDS];
+
+	spin_lock_irqsave(&gsys->rmap_lock, flags);
+	for (i=0 ; i<OLEOLE_GUEST_VIRT_PUDS ; i++)
+		old[i] = __pud(xchg(&pud[i].pud, 0UL));
+	spin_unlock_irqrestore(&gsys->rmap_lock, flags);
+
+	for (i=0 ; i<OLEOLE_GUEST_VIRT_PUDS ; i++)
+		bury_pmd_table(old[i], dead);
+}
+
+
+static void flush_saved_pud(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, struct list_head *dead)
+{
+	oleole_rmap_drop_root(gsys, root);
+	free_pud_entries(gsys, root->pud, dead);
+
+	atomic_long_set(&root->nr_pages, 0);
+}
+
+
+/* O(1) flush of the running shadow, see reactivate_pmd_table() */
+static void deactivate_live_pud(oleole_guest_system_t *gsys, pud_t *pud)
+{
+	oleole_rmap_drop_root(gsys, gsys->cur_root);
+	deactivate_pud(pud);
+}
+
+
+static void deactivate_saved_pud(oleole_guest_system_t *gsys, oleole_shadow_root_t *root)
+{
+	oleole_rmap_drop_root(gsys, root);
+	deactivate_pud(root->pud);
+}
+
+
+static oleole_shadow_root_t *find_shadow_root(oleole_guest_system_t *gsys, uint32_t key)
+{
+	oleole_shadow_root_t *root;
+
+	list_for_each_entry(root, &gsys->roots, lru)
+		if (root->key == key)
+			return root;
+
+	return NULL;
+}
+
+
+/*
+ *  Roots are only freed with the VMA: a fault in flight may still use
+ *  the one that was running when it started.
+ */
+static oleole_shadow_root_t *alloc_shadow_root(oleole_guest_system_t *gsys, uint32_t key,
+					       struct list_head *dead)
+{
+	oleole_shadow_root_t *root;
+
+	if (gsys->nr_roots < OLEOLE_SHADOW_ROOTS_MAX) {
+		root = kzalloc(sizeof(oleole_shadow_root_t), GFP_KERNEL);
+		if (!root)
+			return NULL;
+		INIT_LIST_HEAD(&root->rmap);
+		gsys->nr_roots++;
+	} else {
+		/* recycle the least recently used one */
+		root = list_entry(gsys->roots.prev, oleole_shadow_root_t, lru);
+		list_del(&root->lru);
+		flush_saved_pud(gsys, root, dead);
+	}
+
+	INIT_LIST_HEAD(&root->lru);
+	root->key = key;
+
+	return root;
+}
+
+
+/* Flush least recently used roots until the shadow page budget is met */
+static void shrink_shadow_roots(oleole_guest_system_t *gsys, struct list_head *dead)
+{
+	long total = 0;
+	oleole_shadow_root_t *root;
+
+	list_for_each_entry(root, &gsys->roots, lru)
+		total += atomic_long_read(&root->nr_pages);
+
+	list_for_each_entry_reverse(root, &gsys->roots, lru) {
+		if (total <= OLEOLE_SHADOW_PAGES_MAX)
+			break;
+
+		if (root == gsys->cur_root)
+			break;
+
+		total -= atomic_long_read(&root->nr_pages);
+
+		flush_saved_pud(gsys, root, dead);
+	}
+}
+
+
+/*
+ *  Take or release the right to change the guest-virtual shadow without
+ *  excluding faults: flushes, CR3 loads and INVLPG.  mmap_sem is held
+ *  for reading, which keeps out the users of oleole_lock_faults() and
+ *  the unmapping of the VMA.  Returns NULL if it is gone.
+ */
+static struct mm_struct *lock_shadow(oleole_guest_system_t *gsys)
+{
+	unsigned long flags;
+	struct mm_struct *mm = NULL;
+
 	spin_lock_irqsave(&gsys->lock, flags);
-	vma = gsys->vma;
+	if (gsys->vma && atomic_inc_not_zero(&gsys->vma->vm_mm->mm_users))
+		mm = gsys->vma->vm_mm;
 	spin_unlock_irqrestore(&gsys->lock, flags);
 
-	if (!vma)
-		return -1;
+	if (!mm)
+		return NULL;
+
+	down_read(&mm->mmap_sem);
+
+	if (!gsys->vma) {
+		/* unmapped meanwhile */
+		up_read(&mm->mmap_sem);
+		mmput(mm);
+		return NULL;
+	}
+
+	mutex_lock(&gsys->shadow_mutex);
 
-	mm = vma->vm_mm;
+	/* faults from now until unlock_shadow() start over */
+	oleole_shadow_begin(gsys);
 
+	return mm;
+}
+
+
+/*
+ *  Tables unlinked on the way go after the shootdown, once faults are
+ *  done with them.
+ */
+static void unlock_shadow(oleole_guest_system_t *gsys, struct mm_struct *mm, struct list_head *dead)
+{
+	oleole_shadow_end(gsys);
+
+	mutex_unlock(&gsys->shadow_mutex);
+	up_read(&mm->mmap_sem);
+	mmput(mm);
+
+	free_dead_tables(dead);
+}
+
+
+/*
+ *  Throw away the shadow of the running CR3 in constant time.
+ */
+int oleole_flush_guest_virt_memory(oleole_guest_system_t *gsys)
+{
+	struct mm_struct *mm;
+	pud_t *pud;
+	LIST_HEAD(dead);
+
+	mm = lock_shadow(gsys);
 	if (!mm)
 		return -1;
 
-	start = vma->vm_start + OLEOLE_GUSET_VIRT_SPACE_OFFSET;
-	end   = start         + 0x100000000UL;
+	pud = guest_virt_pud(gsys->vma);
+	if (pud)
+		deactivate_live_pud(gsys, pud);
 
-	down_write(&mm->mmap_sem);
+	oleole_flush_tlb_all(gsys);
 
-	pgd = pgd_offset(mm, start);
-	if (!pgd_present(*pgd))
-		goto miss;
+	unlock_shadow(gsys, mm, &dead);
 
-	for (; start < end ; start += PUD_SIZE) {
-		pud_t *pud;
+	return 0;
+}
+
+
+/*
+ *  Throw away the shadows of every CR3, when guest frames are released
+ *  under them or become shared with a fork.  Deactivated entries would
+ *  not do: get_user_pages_fast() walks the window without looking at the
+ *  upper levels' flags and pins whatever leaf it finds present, writable
+ *  or not.  Once the tables are unlinked, the TLB shootdown waits for
+ *  such walks, which run with interrupts off.  The caller excludes
+ *  faults.
+ */
+void oleole_flush_guest_virt_all(oleole_guest_system_t *gsys)
+{
+	oleole_shadow_root_t *root;
+	pud_t *pud;
+	LIST_HEAD(dead);
+
+	pud = guest_virt_pud(gsys->vma);
+	if (pud) {
+		oleole_rmap_drop_root(gsys, gsys->cur_root);
+		free_pud_entries(gsys, pud, &dead);
+		if (gsys->cur_root)
+			atomic_long_set(&gsys->cur_root->nr_pages, 0);
+	}
+
+	list_for_each_entry(root, &gsys->roots, lru)
+		if (root != gsys->cur_root)
+			flush_saved_pud(gsys, root, &dead);
+
+	oleole_flush_tlb_all(gsys);
+
+	free_dead_tables(&dead);
+}
+
+
+/*
+ *  Same for the guest-physical window, when its frames become shared
+ *  with a fork.  The caller excludes faults.
+ */
+void oleole_flush_guest_phy(oleole_guest_system_t *gsys)
+{
+	unsigned long start;
+	pgd_t *pgd;
+	LIST_HEAD(dead);
+
+	start = gsys->vma->vm_start + OLEOLE_GUSET_PHY_SPACE_OFFSET;
+
+	pgd = pgd_offset(gsys->vma->vm_mm, start);
+	if (oleole_pgd_none(*pgd))
+		return;
+
+	free_pud_entries(gsys, pud_offset(pgd, start), &dead);
+
+	oleole_flush_tlb_all(gsys);
+
+	free_dead_tables(&dead);
+}
+
+
+/*
+ *  Clear _PAGE_RW in every leaf below nr PUD entries; 2MB entries are
+ *  dropped.  Leaves under deactivated entries are done too, since
+ *  get_user_pages_fast() walks through those and a write through its
+ *  pin would never fault to be logged.
+ */
+static void wrprotect_pud_range(pud_t *pud, int nr)
+{
+	int i;
+	unsigned int j, k;
+	unsigned long pmd_occ, pte_occ;
+
+	for (i=0 ; i<nr ; i++, pud++) {
 		pmd_t *pmd;
-		struct page *page;
 
-		pud = pud_offset(pgd, start);
-		if (!pud_present(*pud))
-			goto miss;
+		if (oleole_pud_none(*pud))
+			continue;
+
+		pmd = oleole_pmd_offset(pud, 0);
+		pmd_occ = oleole_occ(pmd);
+		oleole_for_each_occupied(j, pmd_occ) {
+			pte_t *pte;
+
+			if (oleole_pmd_none(pmd[j]))
+				continue;
+
+			if (pmd_large(pmd[j])) {
+				pmd_clear(&pmd[j]);
+				continue;
+			}
+
+			pte = oleole_pte_offset(&pmd[j], 0);
+			pte_occ = oleole_occ(pte);
+			oleole_for_each_occupied(k, pte_occ) {
+				if (pte_present(pte[k]))
+					pte[k] = pte_wrprotect(pte[k]);
+			}
+		}
+	}
+}
 
-		free_pmd_range(pud);
 
-		pmd = pmd_offset(pud, 0);
-		page = virt_to_page(pmd);
-		__free_page(page);
-		pud_clear(pud);
+/*
+ *  Make every shadow mapping of guest memory read-only, so the next
+ *  write to each frame faults (dirty logging).  Shadows of CR3 values
+ *  not running are done as well: they are linked back as they are.
+ *  The caller excludes faults.
+ */
+void oleole_wrprotect_guest_all(oleole_guest_system_t *gsys)
+{
+	oleole_shadow_root_t *root;
+	unsigned long start;
+	pgd_t *pgd;
+	pud_t *pud;
+
+	start = gsys->vma->vm_start + OLEOLE_GUSET_PHY_SPACE_OFFSET;
+
+	pgd = pgd_offset(gsys->vma->vm_mm, start);
+	if (!oleole_pgd_none(*pgd))
+		wrprotect_pud_range(pud_offset(pgd, start), OLEOLE_GUEST_VIRT_PUDS);
+
+	pud = guest_virt_pud(gsys->vma);
+	if (pud)
+		wrprotect_pud_range(pud, OLEOLE_GUEST_VIRT_PUDS);
+
+	list_for_each_entry(root, &gsys->roots, lru)
+		if (root != gsys->cur_root)
+			wrprotect_pud_range(root->pud, OLEOLE_GUEST_VIRT_PUDS);
+
+	oleole_flush_tlb_all(gsys);
+}
+
+
+/*
+ *  Load CR3.
+ *
+ *  The shadow of the outgoing CR3 is unlinked from the PUD table and
+ *  kept in its root; the shadow cached for the incoming one is linked
+ *  back.  Unless OLEOLE_CR3_NOFLUSH is set the incoming shadow is
+ *  deactivated first, which keeps the old flush-everything semantics.
+ *  Faults keep running meanwhile; those that may have walked the old
+ *  CR3 give up before they store anything (see oleole_shadow_seq()).
+ *
+ *  Before mmap there is nothing to shadow and the CR3 is only recorded.
+ *  Returns -ENOMEM, with the old CR3 still loaded, if no root can be
+ *  allocated.
+ */
+int oleole_switch_guest_virt_memory(oleole_guest_system_t *gsys, uint32_t cr3)
+{
+	int i, ret = 0;
+	unsigned long flags;
+	uint32_t key;
+	struct mm_struct *mm;
+	oleole_shadow_root_t *cur, *root;
+	pud_t *pud;
+	LIST_HEAD(dead);
+
+	key = cr3 & ~OLEOLE_CR3_NOFLUSH;
+
+	mm = lock_shadow(gsys);
+	if (!mm) {
+		spin_lock_irqsave(&gsys->lock, flags);
+		gsys->cr3 = key;
+		spin_unlock_irqrestore(&gsys->lock, flags);
+		return 0;
+	}
+
+	pud = guest_virt_pud(gsys->vma);
+	cur = gsys->cur_root;
+
+	if (cur && cur->key == key) {
+		if (!(cr3 & OLEOLE_CR3_NOFLUSH) && pud)
+			deactivate_live_pud(gsys, pud);
+		goto load;
 	}
-miss:
 
-	up_write(&mm->mmap_sem);
+	root = find_shadow_root(gsys, key);
+	if (root) {
+		list_del(&root->lru);
+		if (!(cr3 & OLEOLE_CR3_NOFLUSH))
+			deactivate_saved_pud(gsys, root);
+	} else {
+		root = alloc_shadow_root(gsys, key, &dead);
+	}
+
+	if (!root) {
+		/* nothing has changed yet */
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (!cur)
+		oleole_rmap_drop_root(gsys, NULL);
+
+	/*
+	 *  Swap the shadows under rmap_lock, so that root_pud() never sees a
+	 *  root half switched.  A rootless outgoing shadow is freed.
+	 */
+	spin_lock_irqsave(&gsys->rmap_lock, flags);
+	for (i=0 ; i<OLEOLE_GUEST_VIRT_PUDS ; i++) {
+		pud_t old = __pud(0);
+
+		if (pud)
+			old = __pud(xchg(&pud[i].pud, pud_val(root->pud[i])));
+
+		if (cur)
+			cur->pud[i] = old;
+		else
+			bury_pmd_table(old, &dead);
+
+		root->pud[i] = __pud(0);
+	}
+	gsys->cur_root = root;
+	spin_unlock_irqrestore(&gsys->rmap_lock, flags);
+
+	list_add(&root->lru, &gsys->roots);
+
+	shrink_shadow_roots(gsys, &dead);
+
+load:
+	spin_lock_irqsave(&gsys->lock, flags);
+	gsys->cr3 = key;
+	spin_unlock_irqrestore(&gsys->lock, flags);
+
+	oleole_flush_tlb_all(gsys);
+
+out:
+	unlock_shadow(gsys, mm, &dead);
+
+	return ret;
+}
+
+
+/*
+ *  INVLPG on a batch of guest-virtual ranges of the running CR3.
+ *
+ *  Only the shadow PTEs of the ranges are cleared.  A single page is
+ *  shot down from the TLBs by itself, anything more with one flush of
+ *  the address space.
+ */
+int oleole_invalidate_guest_virt(oleole_guest_system_t *gsys, const struct oleole_range *ranges, unsigned int nr)
+{
+	unsigned int i;
+	unsigned long flags, total = 0;
+	uint32_t cr3;
+	struct mm_struct *mm;
+	LIST_HEAD(dead);
+
+	spin_lock_irqsave(&gsys->lock, flags);
+	cr3 = gsys->cr3;
+	spin_unlock_irqrestore(&gsys->lock, flags);
+
+	for (i=0 ; i<nr ; i++)
+		total += ranges[i].pages ? ranges[i].pages : 1;
+
+	if (OLEOLE_INVLPG_FLUSH_ALL < total) {
+		oleole_gtlb_flush(&gsys->gtlb);
+	} else {
+		for (i=0 ; i<nr ; i++) {
+			unsigned long n, pages = ranges[i].pages ? ranges[i].pages : 1;
+			for (n=0 ; n<pages ; n++)
+				oleole_gtlb_flush_page(&gsys->gtlb, cr3, ranges[i].start + n * PAGE_SIZE);
+		}
+	}
+
+	mm = lock_shadow(gsys);
+	if (!mm)
+		return 0;
+
+	for (i=0 ; i<nr ; i++) {
+		unsigned long start, pages;
 
-	__flush_tlb();
+		start = ranges[i].start & PAGE_MASK;
+		pages = ranges[i].pages ? ranges[i].pages : 1;
+
+		oleole_zap_guest_virt_range(gsys, gsys->cur_root, start, pages * PAGE_SIZE);
+	}
+
+	if (total == 1)
+		oleole_flush_tlb_page(gsys, gsys->vma->vm_start + OLEOLE_GUSET_VIRT_SPACE_OFFSET +
+				      (ranges[0].start & PAGE_MASK));
+	else
+		oleole_flush_tlb_all(gsys);
+
+	unlock_shadow(gsys, mm, &dead);
 
 	return 0;
 }
 
 
+/*
+ *  Free the shadows cached for CR3 values other than the running one and
+ *  the roots themselves.  The running shadow is freed with the VMA.
+ *  Faults are excluded.
+ */
+void oleole_free_shadow_roots(oleole_guest_system_t *gsys)
+{
+	oleole_shadow_root_t *root, *next;
+	LIST_HEAD(dead);
+
+	oleole_rmap_drop_root(gsys, NULL);
+
+	list_for_each_entry_safe(root, next, &gsys->roots, lru) {
+		if (root != gsys->cur_root)
+			flush_saved_pud(gsys, root, &dead);
+		else
+			oleole_rmap_drop_root(gsys, root);
+		list_del(&root->lru);
+		kfree(root);
+	}
+
+	gsys->nr_roots = 0;
+	gsys->cur_root = NULL;
+
+	free_dead_tables(&dead);
+}
+
+
+/****************************************************************************/
+/* Shadow entries of one root                                               */
+/****************************************************************************/
+
+static pud_t *root_pud(oleole_guest_system_t *gsys, oleole_shadow_root_t *root)
+{
+	if (root == gsys->cur_root)
+		return gsys->vma ? guest_virt_pud(gsys->vma) : NULL;
+
+	return root->pud;
+}
+
+
+/*
+ *  Lock of the shadow PTE table under pmd in root.  Only the running
+ *  root is reached by faults; saved roots are left alone by them.
+ */
+static spinlock_t *root_pte_lockptr(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, pmd_t *pmd)
+{
+	if (root != gsys->cur_root)
+		return NULL;
+
+	return oleole_pte_lockptr(gsys->vma->vm_mm, pmd);
+}
+
+
+/* Same for the shadow PMD table under pud, where 2MB entries live */
+static spinlock_t *root_pmd_lockptr(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, pud_t *pud)
+{
+	if (root != gsys->cur_root)
+		return NULL;
+
+	return oleole_pmd_lockptr(gsys->vma->vm_mm, pud);
+}
+
+
+/* Shadow PTE of guest-virtual address gva in root, or NULL */
+static pte_t *root_pte(oleole_guest_system_t *gsys, oleole_shadow_root_t *root, unsigned long gva, spinlock_t **ptlp)
+{
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pud = root_pud(gsys, root);
+	if (!pud)
+		return NULL;
+
+	pud += gva >> PUD_SHIFT;
+	if (oleole_pud_none(*pud))
+		return NULL;
+
+	pmd = oleole_pmd_offset(pud, gva);
+	if (oleole_pmd_none(*pmd) || pmd_large(*pmd))
+		return NULL;
+
+	*ptlp = root_pte_lockptr(gsys, root, pmd);
+
+	return oleole_pte_offset(pmd, gva);
+}
+
+
+/*
+ *  Clear the shadow PTEs of [gva, gva + size) in root.  Tables are kept.
+ *  Returns 1 if root is the running one and the TLB must be flushed.
+ */
+int oleole_zap_guest_virt_range(oleole_guest_system_t *gsys, oleole_shadow_root_t *root,
+				uint32_t gva, unsigned long size)
+{
+	unsigned long addr, end, next;
+	pud_t *pud;
+
+	pud = root_pud(gsys, root);
+	if (!pud)
+		return 0;
+
+	end = (unsigned long)gva + size;
+
+	for (addr = gva ; addr < end ; addr = next) {
+		pud_t *p = pud + (addr >> PUD_SHIFT);
+		pmd_t *pmd;
+		pte_t *pte;
+		spinlock_t *ptl;
+		unsigned int i, last;
+		unsigned long occ;
+
+		if (oleole_pud_none(*p)) {
+			next = min((addr + PUD_SIZE) & PUD_MASK, end);
+			continue;
+		}
+
+		/* skip to the next occupied group of PMD entries */
+		i = oleole_occ_next(oleole_occ(oleole_pmd_offset(p, 0)), pmd_index(addr));
+		if (i != pmd_index(addr)) {
+			next = min((addr & PUD_MASK) + i * PMD_SIZE, end);
+			continue;
+		}
+
+		next = (addr + PMD_SIZE) & PMD_MASK;
+		if (end < next)
+			next = end;
+
+		pmd = oleole_pmd_offset(p, addr);
+		if (pmd_large(*pmd)) {
+			/* large segment: refaulted as a whole */
+			ptl = root_pmd_lockptr(gsys, root, p);
+			if (ptl)
+				spin_lock(ptl);
+			if (pmd_large(*pmd))
+				*pmd = __pmd(0);
+			if (ptl)
+				spin_unlock(ptl);
+			continue;
+		}
+
+		if (oleole_pmd_none(*pmd))
+			continue;
+
+		ptl = root_pte_lockptr(gsys, root, pmd);
+		if (ptl)
+			spin_lock(ptl);
+
+		pte = oleole_pte_offset(pmd, 0);
+		occ = oleole_occ(pte);
+		last = pte_index(next - 1);
+		for (i = oleole_occ_next(occ, pte_index(addr)) ; i <= last ; i = oleole_occ_next(occ, i + 1))
+			pte[i] = __pte(0);
+
+		if (ptl)
+			spin_unlock(ptl);
+	}
+
+	return root == gsys->cur_root;
+}
+
+
+/*
+ *  Make guest-virtual page gva of root read-only if it maps frame gfn.
+ *  Returns 1 if the TLBs must be flushed; the caller does that once
+ *  rmap_lock is released.
+ */
+int oleole_wrprotect_guest_virt(oleole_guest_system_t *gsys, oleole_shadow_root_t *root,
+				uint32_t gva, uint32_t gfn)
+{
+	pte_t *pte;
+	struct page *page;
+	spinlock_t *ptl = NULL;
+
+	pte = root_pte(gsys, root, gva, &ptl);
+	if (!pte)
+		return 0;
+
+	page = oleole_get_guest_phy_page(gsys, (unsigned long)gfn << PAGE_SHIFT);
+
+	if (ptl)
+		spin_lock(ptl);
+
+	if (!pte_present(*pte) || (pte_val(*pte) & _PAGE_DEACTIVATED) ||
+	    !page || pte_pfn(*pte) != page_to_pfn(page)) {
+		if (ptl)
+			spin_unlock(ptl);
+		return 0;
+	}
+
+	*pte = pte_wrprotect(*pte);
+
+	if (ptl)
+		spin_unlock(ptl);
+
+	return root == gsys->cur_root;
+}
+
+
+/*
+ *  Make the guest-physical window mapping of frame gfn read-only.
+ *  Returns 1 if the TLBs must be flushed, as above.
+ */
+int oleole_wrprotect_guest_phy(oleole_guest_system_t *gsys, uint32_t gfn)
+{
+	int ret;
+	unsigned long address;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+	spinlock_t *ptl;
+
+	if (!gsys->vma)
+		return 0;
+
+	address = gsys->vma->vm_start + OLEOLE_GUSET_PHY_SPACE_OFFSET + ((unsigned long)gfn << PAGE_SHIFT);
+
+	pgd = pgd_offset(gsys->vma->vm_mm, address);
+	if (pgd_none(*pgd))
+		return 0;
+
+	pud = pud_offset(pgd, address);
+	if (oleole_pud_none(*pud))
+		return 0;
+
+	pmd = pmd_offset(pud, address);
+	ptl = oleole_pmd_lockptr(gsys->vma->vm_mm, pud);
+	spin_lock(ptl);
+	if (pmd_large(*pmd)) {
+		/* split: the frame is refaulted with a 4KB mapping */
+		pmd_clear(pmd);
+		spin_unlock(ptl);
+		return 1;
+	}
+	spin_unlock(ptl);
+
+	if (oleole_get_gPTE_offset_without_alloc(gsys->vma->vm_mm, &pte, address))
+		return 0;
+
+	ptl = oleole_pte_lockptr(gsys->vma->vm_mm, pmd);
+	spin_lock(ptl);
+
+	ret = pte_present(*pte) && pte_write(*pte);
+	if (ret)
+		*pte = pte_wrprotect(*pte);
+
+	spin_unlock(ptl);
+
+	return ret;
+}
+
+
+/*
+ *  Clear the guest-physical window over [addr, addr + size).  Used when
+ *  frames that may be mapped to the zero page get populated, and when
+ *  frames are released.  2MB entries overlapping the range go as well.
+ *  A single entry is shot down by itself, more with one flush.
+ */
+void oleole_zap_guest_phy_range(oleole_guest_system_t *gsys, unsigned long addr, unsigned long size)
+{
+	unsigned long start, end, next, last = 0;
+	unsigned int zapped = 0;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+	spinlock_t *ptl;
+
+	if (!gsys->vma)
+		return;
+
+	start = gsys->vma->vm_start + OLEOLE_GUSET_PHY_SPACE_OFFSET + addr;
+	end   = start + size;
+
+	for ( ; start < end ; start = next) {
+		next = (start + PMD_SIZE) & PMD_MASK;
+		if (end < next)
+			next = end;
+
+		pgd = pgd_offset(gsys->vma->vm_mm, start);
+		if (pgd_none(*pgd))
+			continue;
+
+		pud = pud_offset(pgd, start);
+		if (oleole_pud_none(*pud))
+			continue;
+
+		pmd = pmd_offset(pud, start);
+		if (oleole_pmd_none(*pmd))
+			continue;
+
+		if (pmd_large(*pmd)) {
+			pmd_clear(pmd);
+			last = start;
+			zapped++;
+			continue;
+		}
+
+		ptl = oleole_pte_lockptr(gsys->vma->vm_mm, pmd);
+		spin_lock(ptl);
+
+		pte = oleole_pte_offset(pmd, start);
+		for ( ; start < next ; start += PAGE_SIZE, pte++) {
+			if (oleole_pte_none(*pte))
+				continue;
+			*pte = __pte(0);
+			last = start;
+			zapped++;
+		}
+
+		spin_unlock(ptl);
+	}
+
+	if (zapped == 1)
+		oleole_flush_tlb_page(gsys, last);
+	else if (zapped)
+		oleole_flush_tlb_all(gsys);
+}
+
+
 /****************************************************************************/
 /*                                                                          */
 /****************************************************************************/
+struct page *oleole_get_guest_phy_page(oleole_guest_system_t *gsys, unsigned long addr)
+{
+	unsigned long pfn;
+
+	if (gsys->guest_phy_mem_size <= addr)
+		return NULL;
+
+	rcu_read_lock();
+	pfn = ACCESS_ONCE(rcu_dereference(gsys->frames)->pfn[addr >> PAGE_SHIFT]);
+	rcu_read_unlock();
+
+	if (!pfn)
+		return NULL;
+
+	/* pairs with smp_wmb() in publish_frames() */
+	smp_rmb();
+
+	return pfn_to_page(pfn);
+}
+
+
+/* Is the 2MB chunk containing addr backed by one contiguous, aligned block? */
+int oleole_guest_phy_huge(oleole_guest_system_t *gsys, unsigned long addr)
+{
+	int ret;
+
+	if (gsys->guest_phy_mem_size <= addr)
+		return 0;
+
+	rcu_read_lock();
+	ret = test_bit(addr >> PMD_SHIFT, rcu_dereference(gsys->frames)->huge_map);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+
 int oleole_read_guest_phy_word(oleole_guest_system_t *gsys, uint32_t addr, uint32_t *result)
 {
-	int page_index;
-	unsigned long flags;
 	struct page *page;
 	uint8_t *p;
 
 	if (gsys->guest_phy_mem_size < addr + sizeof(uint32_t))
 		return -1;
 
-	page_index = addr >> PAGE_SHIFT;
+	rcu_read_lock();
 
-	spin_lock_irqsave(&guest_phy_page_table[page_index].lock, flags);
-	page = guest_phy_page_table[page_index].page;
-	spin_unlock_irqrestore(&guest_phy_page_table[page_index].lock, flags);
-
-	if (!page)
-		return -1;
+	page = oleole_get_guest_phy_page(gsys, addr);
+	if (!page) {
+		/* untouched: reads as zero */
+		rcu_read_unlock();
+		*result = 0;
+		return 0;
+	}
 	
 	p = (uint8_t *)page_address(page);
 
 	*result = *(uint32_t*)(p + (addr & ~PAGE_MASK));
 
+	rcu_read_unlock();
+
+	return 0;
+}
+
+
+/*
+ *  Set bits in the present guest entry at addr on behalf of the MMU,
+ *  and return the entry.  The guest may be changing it meanwhile, so
+ *  this is a cmpxchg loop, and a shared table frame is copied first.
+ *  frame_lock keeps the frame from being replaced under the update.
+ */
+int oleole_set_guest_phy_bits(oleole_guest_system_t *gsys, uint32_t addr, uint32_t bits, uint32_t *result)
+{
+	struct page *page;
+	uint32_t *p, old, cur;
+
+	if (gsys->guest_phy_mem_size < addr + sizeof(uint32_t))
+		return -1;
+
+retry:
+	page = oleole_get_guest_phy_page(gsys, addr);
+	if (!page) {
+		*result = 0;	/* untouched: not present */
+		return 0;
+	}
+
+	if (gsys->cow && oleole_frame_shared(page)) {
+		if (oleole_cow_guest_phy_page(gsys, addr, page) < 0)
+			return -1;
+		goto retry;
+	}
+
+	spin_lock(&gsys->frame_lock);
+
+	if (oleole_get_guest_phy_page(gsys, addr) != page) {
+		spin_unlock(&gsys->frame_lock);
+		goto retry;
+	}
+
+	p = (uint32_t *)((uint8_t *)page_address(page) + (addr & ~PAGE_MASK));
+
+	old = ACCESS_ONCE(*p);
+	while ((old & OLEOLE_PTE_PRESENT) && (old & bits) != bits) {
+		cur = cmpxchg(p, old, old | bits);
+		if (cur == old) {
+			old |= bits;
+			oleole_dirty_track(gsys, addr >> PAGE_SHIFT, 1);
+			break;
+		}
+		old = cur;
+	}
+
+	spin_unlock(&gsys->frame_lock);
+
+	*result = old;
+
 	return 0;
 }
@@ -6,14 +6,51 @@
 #define OLEOLE_GUEST_PHY_MEMORY_PAGES (1048576UL)
 #define OLEOLE_GUEST_PHY_PAGE_SIZE    (4096)
 
+/* Guest physical memory is allocated in 2MB chunks where possible */
+#define OLEOLE_GUEST_PHY_HUGE_ORDER   (9)
+
 #define OLEOLE_GUSET_PHY_SPACE_OFFSET  (0UL)
 #define OLEOLE_GUSET_VIRT_SPACE_OFFSET (0x200000000UL)
 
-#define OLEOLE_PTE_PRESENT_BIT (0)
-#define OLEOLE_PTE_WP_BIT      (1)
+/* A segment-table entry maps 4MB */
+#define OLEOLE_SEGMENT_SHIFT   (22)
+#define OLEOLE_SEGMENT_SIZE    (1UL << OLEOLE_SEGMENT_SHIFT)
+#define OLEOLE_SEGMENT_MASK    (~(OLEOLE_SEGMENT_SIZE - 1))
+
+/*
+ *  CR3 layout
+ *    [31:12] segment-table origin
+ *    [11]    NOFLUSH: keep the cached shadow of this address space
+ *    [7:0]   ASID
+ */
+#define OLEOLE_CR3_STO_MASK    (0xFFFFF000U)
+#define OLEOLE_CR3_NOFLUSH     (0x00000800U)
+#define OLEOLE_CR3_ASID_MASK   (0x000000FFU)
+
+#define OLEOLE_PTE_PRESENT_BIT  (0)
+#define OLEOLE_PTE_WP_BIT       (1)
+#define OLEOLE_PTE_ACCESSED_BIT (5)
+#define OLEOLE_PTE_DIRTY_BIT    (6)
 
 #define OLEOLE_PTE_PRESENT     (1U << OLEOLE_PTE_PRESENT_BIT)
 #define OLEOLE_PTE_WP          (1U << OLEOLE_PTE_WP_BIT)
 
+/*
+ *  Accessed and dirty, set by the host as on x86: A in every STE and
+ *  PTE used for a translation, D in the PTE (or large STE) on the first
+ *  write through it.  The guest clears them and then invalidates.
+ */
+#define OLEOLE_PTE_ACCESSED    (1U << OLEOLE_PTE_ACCESSED_BIT)
+#define OLEOLE_PTE_DIRTY       (1U << OLEOLE_PTE_DIRTY_BIT)
+
+/*
+ *  Large segment: an STE with this bit maps the 4MB guest-physical
+ *  region at STE[31:22] directly, without a page table.
+ */
+#define OLEOLE_STE_LARGE_BIT   (2)
+
+#define OLEOLE_STE_LARGE       (1U << OLEOLE_STE_LARGE_BIT)
+#define OLEOLE_STE_LARGE_MASK  (0xFFC00000U)
+
 #endif /* _LINUX_OLEOLE_H */
 
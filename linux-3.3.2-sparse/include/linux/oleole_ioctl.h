@@ -6,8 +6,35 @@
 
 #define OLEOLE_IOC_MAGIC 'o'
 
+/* Guest-virtual range for OLEOLE_IOC_INVLPG_VEC */
+struct oleole_range {
+	__u32 start;		/* guest virtual address */
+	__u32 pages;		/* number of 4KB pages, 0 means 1 */
+};
+
+struct oleole_invlpg_vec {
+	__u64 ranges;		/* user pointer to struct oleole_range[] */
+	__u32 count;
+	__u32 flags;		/* must be 0 */
+};
+
+/* Argument of OLEOLE_IOC_GET_DIRTY_LOG */
+struct oleole_dirty_log {
+	__u64 bitmap;		/* user pointer, one bit per guest frame */
+	__u64 size;		/* bytes available at bitmap */
+};
+
 #define OLEOLE_IOC_START		_IOW(OLEOLE_IOC_MAGIC, 1, __u64)
 #define OLEOLE_IOC_SETCR3		_IOW(OLEOLE_IOC_MAGIC, 2, __u32)
+#define OLEOLE_IOC_FAULT_AROUND		_IOW(OLEOLE_IOC_MAGIC, 3, __u32)
+#define OLEOLE_IOC_COHERENT		_IOW(OLEOLE_IOC_MAGIC, 4, __u32)
+#define OLEOLE_IOC_INVLPG		_IOW(OLEOLE_IOC_MAGIC, 5, __u32)
+#define OLEOLE_IOC_INVLPG_VEC		_IOW(OLEOLE_IOC_MAGIC, 6, struct oleole_invlpg_vec)
+/* Allocate all guest memory up front; only before mmap, -EBUSY after */
+#define OLEOLE_IOC_POPULATE		_IO(OLEOLE_IOC_MAGIC, 7)
+#define OLEOLE_IOC_NODEMASK		_IOW(OLEOLE_IOC_MAGIC, 8, __u64)
+#define OLEOLE_IOC_DIRTY_LOG		_IOW(OLEOLE_IOC_MAGIC, 9, __u32)
+#define OLEOLE_IOC_GET_DIRTY_LOG	_IOW(OLEOLE_IOC_MAGIC, 10, struct oleole_dirty_log)
 
 #endif /* _LINUX_OLEOLE_IOCTL_H */
 
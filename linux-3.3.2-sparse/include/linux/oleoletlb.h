@@ -27,6 +27,27 @@ extern void oleolevm_free_pgd_range(struct mmu_gather *tlb,
 				    unsigned long floor,
 				    unsigned long ceiling);
 
+extern int oleolevm_copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
+				    struct vm_area_struct *vma);
+
+extern long oleolevm_madvise_willneed(struct vm_area_struct *vma,
+				      unsigned long start, unsigned long end);
+
+extern long oleolevm_madvise_dontneed(struct vm_area_struct *vma,
+				      unsigned long start, unsigned long end);
+
+extern int oleolevm_follow_page(struct mm_struct *mm, struct vm_area_struct *vma,
+				struct page **pages, struct vm_area_struct **vmas,
+				unsigned long *position, int *length, int i,
+				unsigned int flags);
+
+extern int oleolevm_fast_fault(struct mm_struct *mm, unsigned long address,
+			       unsigned int flags, struct pt_regs *regs,
+			       unsigned long error_code);
+
+extern void oleolevm_lock_faults(struct vm_area_struct *vma);
+extern void oleolevm_unlock_faults(struct vm_area_struct *vma);
+
 #else
 
 static inline int is_vm_oleoletlb_page(struct vm_area_struct *vma)
@@ -49,6 +70,52 @@ oleolevm_free_pgd_range(struct mmu_gather *tlb, struct vm_area_struct *vma,
 {
 }
 
+static inline int
+oleolevm_copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
+			 struct vm_area_struct *vma)
+{
+	return -ENOMEM;
+}
+
+static inline long
+oleolevm_madvise_willneed(struct vm_area_struct *vma,
+			  unsigned long start, unsigned long end)
+{
+	return -EINVAL;
+}
+
+static inline long
+oleolevm_madvise_dontneed(struct vm_area_struct *vma,
+			  unsigned long start, unsigned long end)
+{
+	return -EINVAL;
+}
+
+static inline int
+oleolevm_follow_page(struct mm_struct *mm, struct vm_area_struct *vma,
+		     struct page **pages, struct vm_area_struct **vmas,
+		     unsigned long *position, int *length, int i,
+		     unsigned int flags)
+{
+	return i ? i : -EFAULT;
+}
+
+static inline int
+oleolevm_fast_fault(struct mm_struct *mm, unsigned long address,
+		    unsigned int flags, struct pt_regs *regs,
+		    unsigned long error_code)
+{
+	return 0;
+}
+
+static inline void oleolevm_lock_faults(struct vm_area_struct *vma)
+{
+}
+
+static inline void oleolevm_unlock_faults(struct vm_area_struct *vma)
+{
+}
+
 #endif
 
 #endif /* _LINUX_OLEOLETLB_H */
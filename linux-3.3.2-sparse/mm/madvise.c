@@ -128,6 +128,11 @@ static long madvise_willneed(struct vm_area_struct * vma,
 {
 	struct file *file = vma->vm_file;
 
+	if (is_vm_oleoletlb_page(vma)) {
+		*prev = vma;
+		return oleolevm_madvise_willneed(vma, start, end);
+	}
+
 	if (!file)
 		return -EBADF;
 
@@ -170,9 +175,14 @@ static long madvise_dontneed(struct vm_area_struct * vma,
 			     unsigned long start, unsigned long end)
 {
 	*prev = vma;
-	if (vma->vm_flags & (VM_LOCKED|VM_HUGETLB|VM_OLEOLETLB|VM_PFNMAP))
+	if (vma->vm_flags & (VM_LOCKED|VM_HUGETLB|VM_PFNMAP))
 		return -EINVAL;
 
+	if (is_vm_oleoletlb_page(vma)) {
+		*prev = NULL;	/* tell sys_madvise we drop mmap_sem */
+		return oleolevm_madvise_dontneed(vma, start, end);
+	}
+
 	if (unlikely(vma->vm_flags & VM_NONLINEAR)) {
 		struct zap_details details = {
 			.nonlinear_vma = vma,
@@ -1079,7 +1079,7 @@ int copy_page_range(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		return copy_hugetlb_page_range(dst_mm, src_mm, vma);
 
 	if (is_vm_oleoletlb_page(vma))
-		return -ENOMEM;
+		return oleolevm_copy_page_range(dst_mm, src_mm, vma);
 
 	if (unlikely(is_pfn_mapping(vma))) {
 		/*
@@ -1744,7 +1744,9 @@ int __get_user_pages(struct task_struct *tsk, struct mm_struct *mm,
 		}
 
 		if (is_vm_oleoletlb_page(vma)) {
-                    return -EFAULT;
+			i = oleolevm_follow_page(mm, vma, pages, vmas,
+					&start, &nr_pages, i, gup_flags);
+			continue;
 		}
 
 		do {
@@ -657,6 +657,13 @@ static int mbind_range(struct mm_struct *mm, unsigned long start,
 		if (mpol_equal(vma_policy(vma), new_pol))
 			continue;
 
+		/* an oleole window only takes a policy as a whole */
+		if (is_vm_oleoletlb_page(vma) &&
+		    (vma->vm_start != vmstart || vma->vm_end != vmend)) {
+			err = -EINVAL;
+			goto out;
+		}
+
 		pgoff = vma->vm_pgoff +
 			((vmstart - vma->vm_start) >> PAGE_SHIFT);
 		prev = vma_merge(mm, prev, vmstart, vmend, vma->vm_flags,
@@ -677,7 +684,13 @@ static int mbind_range(struct mm_struct *mm, unsigned long start,
 			if (err)
 				goto out;
 		}
-		err = policy_vma(vma, new_pol);
+		if (is_vm_oleoletlb_page(vma)) {
+			/* its faults may not hold mmap_sem */
+			oleolevm_lock_faults(vma);
+			err = policy_vma(vma, new_pol);
+			oleolevm_unlock_faults(vma);
+		} else
+			err = policy_vma(vma, new_pol);
 		if (err)
 			goto out;
 	}